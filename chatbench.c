@@ -0,0 +1,544 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include "msg_struct.h"
+#include "common.h"
+#include "wire.h"
+#include "metrics.h"
+
+/*
+ * chatbench : générateur de charge pour server.c.
+ *
+ * Ouvre des milliers de connexions simulées, enregistre un pseudo pour
+ * chacune, répartit les clients dans des salons (MULTICAST_CREATE puis
+ * MULTICAST_JOIN), puis envoie un mélange d'unicast, de broadcast et de
+ * messages de salon au débit demandé. Chaque payload porte l'instant
+ * d'envoi prévu : la latence est mesurée à la réception, destinataire par
+ * destinataire, sans omettre les envois retardés par un client saturé.
+ */
+
+#define MAX_EVENTS 256
+#define SETUP_TIMEOUT 30
+#define DRAIN_TIMEOUT 5
+#define BENCH_MAGIC "CB"
+
+typedef enum {
+    STATE_HELLO,     // PROTO_HELLO envoyé, réponse attendue
+    STATE_NICK,      // NICKNAME_NEW envoyé
+    STATE_REGISTERED,
+    STATE_JOINING,   // MULTICAST_CREATE ou MULTICAST_JOIN envoyé
+    STATE_READY
+} BenchState;
+
+typedef struct {
+    int fd;
+    int index;
+    BenchState state;
+    int wire_version;
+    char nickname[NICK_LEN];
+    int channel;  // Numéro du salon, -1 si aucun
+    WireBuffer *in;
+    unsigned char *out;  // Octets pas encore acceptés par la socket
+    size_t out_len;
+    size_t out_cap;
+    int want_write;
+} BenchClient;
+
+typedef struct {
+    int clients;
+    double rate;      // Messages envoyés par seconde, tous clients confondus
+    double duration;  // Secondes
+    int mix[3];       // Poids unicast, broadcast, salon
+    int group;        // Membres par salon, 0 : pas de salons
+    int payload_size;
+    int wire_version;
+} BenchConfig;
+
+enum { KIND_UNICAST, KIND_BROADCAST, KIND_CHANNEL };
+
+static BenchConfig config = {
+    .clients = 1000,
+    .rate = 1000,
+    .duration = 10,
+    .mix = { 80, 5, 15 },
+    .group = 10,
+    .payload_size = 64,
+    .wire_version = WIRE_V2,
+};
+
+static BenchClient *clients;
+static int epfd;
+static Histogram latency;
+static uint64_t delivered;
+static uint64_t expected;
+static uint64_t sent_by_kind[3];
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// Utilitaires
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// xorshift64* : tirages reproductibles d'une exécution à l'autre
+uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl()");
+        return -1;
+    }
+    return 0;
+}
+
+void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit()");
+        return;
+    }
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("setrlimit()");
+    }
+}
+
+// Écriture : les trames s'accumulent dans le tampon du client tant que la
+// socket les refuse
+void set_write_interest(BenchClient *client, int enable) {
+    if (client->want_write == enable) return;
+    client->want_write = enable;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (enable ? EPOLLOUT : 0);
+    ev.data.ptr = client;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+        perror("epoll_ctl(MOD)");
+    }
+}
+
+void flush_client(BenchClient *client) {
+    size_t done = 0;
+    while (done < client->out_len) {
+        ssize_t ret = send(client->fd, client->out + done, client->out_len - done, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            perror("send()");
+            exit(EXIT_FAILURE);
+        }
+        done += ret;
+    }
+
+    memmove(client->out, client->out + done, client->out_len - done);
+    client->out_len -= done;
+    set_write_interest(client, client->out_len > 0);
+}
+
+void send_frame(BenchClient *client, struct message *msg, const char *payload) {
+    size_t bound = wire_frame_bound(client->wire_version, msg->pld_len);
+    if (client->out_len + bound > client->out_cap) {
+        size_t cap = client->out_cap ? client->out_cap : 4096;
+        while (client->out_len + bound > cap) cap *= 2;
+        unsigned char *out = realloc(client->out, cap);
+        if (!out) {
+            perror("realloc() output buffer");
+            exit(EXIT_FAILURE);
+        }
+        client->out = out;
+        client->out_cap = cap;
+    }
+
+    int was_empty = client->out_len == 0;
+    client->out_len += wire_encode(client->wire_version, msg, payload, client->out + client->out_len);
+    if (was_empty) flush_client(client);
+}
+
+void send_command(BenchClient *client, enum msg_type type, const char *infos) {
+    struct message msg = {0};
+    msg.type = type;
+    strncpy(msg.nick_sender, client->nickname, NICK_LEN - 1);
+    strncpy(msg.infos, infos, INFOS_LEN - 1);
+    send_frame(client, &msg, NULL);
+}
+
+void channel_name(int channel, char *name, size_t size) {
+    snprintf(name, size, "bench%d", channel);
+}
+
+// Réception
+void handle_bench_message(BenchClient *client, struct message *msg, const char *payload) {
+    switch (msg->type) {
+        case PROTO_HELLO:
+            if (client->state == STATE_HELLO) {
+                int version = atoi(msg->infos);
+                client->wire_version = version >= WIRE_V2 && version <= WIRE_VERSION ? version : WIRE_LEGACY;
+                client->state = STATE_NICK;
+                send_command(client, NICKNAME_NEW, client->nickname);
+            }
+            break;
+
+        case NICKNAME_NEW:
+            if (client->state == STATE_NICK && strcmp(msg->infos, client->nickname) == 0) {
+                client->state = STATE_REGISTERED;
+            } else if (client->state == STATE_NICK) {
+                fprintf(stderr, "%s: %s\n", client->nickname, msg->infos);
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case ECHO_SEND:
+            // Les réponses à MULTICAST_CREATE et MULTICAST_JOIN se terminent par "You have joined <salon>"
+            if (client->state == STATE_JOINING && strstr(msg->infos, "You have joined")) {
+                client->state = STATE_READY;
+            }
+            break;
+
+        case UNICAST_SEND:
+        case BROADCAST_SEND:
+        case MULTICAST_SEND:
+            if (msg->pld_len > 2 && strncmp(payload, BENCH_MAGIC, 2) == 0) {
+                uint64_t sent_at = strtoull(payload + 2, NULL, 16);
+                uint64_t now = now_ns();
+                hist_record(&latency, now > sent_at ? now - sent_at : 0);
+                delivered++;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+void read_client(BenchClient *client) {
+    WireBuffer *in = client->in;
+    wire_buffer_compact(in);
+    ssize_t rec = recv(client->fd, in->data + in->end, WIRE_BUF_SIZE - in->end, 0);
+    if (rec < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (rec <= 0) {
+        fprintf(stderr, "%s: connection closed by server\n", client->nickname);
+        exit(EXIT_FAILURE);
+    }
+    in->end += rec;
+
+    struct message msg;
+    char payload[MSG_LEN];
+    int ret;
+    // Le format peut changer après la réponse à PROTO_HELLO
+    while ((ret = wire_buffer_next(in, client->wire_version, &msg, payload)) == 1) {
+        handle_bench_message(client, &msg, payload);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: malformed frame\n", client->nickname);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Traite les événements pendant au plus timeout_ms
+void poll_events(int timeout_ms) {
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return;
+        perror("epoll_wait()");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+        BenchClient *client = events[i].data.ptr;
+        if (events[i].events & EPOLLOUT) flush_client(client);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_client(client);
+    }
+}
+
+// Clients qui attendent encore la réponse du serveur à une commande
+int count_waiting(void) {
+    int count = 0;
+    for (int i = 0; i < config.clients; i++) {
+        BenchState state = clients[i].state;
+        if (state == STATE_HELLO || state == STATE_NICK || state == STATE_JOINING) count++;
+    }
+    return count;
+}
+
+void wait_for_replies(const char *what) {
+    uint64_t deadline = now_ns() + SETUP_TIMEOUT * 1000000000ULL;
+    while (count_waiting() > 0) {
+        if (now_ns() > deadline) {
+            fprintf(stderr, "Timeout while %s (%d clients still waiting)\n", what, count_waiting());
+            exit(EXIT_FAILURE);
+        }
+        poll_events(10);
+    }
+}
+
+// Mise en place
+void connect_clients(const char *host, const char *port) {
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < config.clients; i++) {
+        BenchClient *client = &clients[i];
+        client->index = i;
+        client->channel = -1;
+        client->wire_version = WIRE_LEGACY;
+        snprintf(client->nickname, NICK_LEN, "bench%d", i);
+        client->in = calloc(1, sizeof(WireBuffer));
+        if (!client->in) {
+            perror("calloc() input buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        client->fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (client->fd == -1 || connect(client->fd, res->ai_addr, res->ai_addrlen) == -1) {
+            perror("connect()");
+            exit(EXIT_FAILURE);
+        }
+        int yes = 1;
+        setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        if (set_nonblocking(client->fd) == -1) exit(EXIT_FAILURE);
+
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client->fd, &ev) == -1) {
+            perror("epoll_ctl(ADD)");
+            exit(EXIT_FAILURE);
+        }
+
+        if (config.wire_version > WIRE_LEGACY) {
+            char version[16];
+            snprintf(version, sizeof(version), "%d", config.wire_version);
+            client->state = STATE_HELLO;
+            send_command(client, PROTO_HELLO, version);
+        } else {
+            client->state = STATE_NICK;
+            send_command(client, NICKNAME_NEW, client->nickname);
+        }
+
+        // Ne pas laisser déborder la file d'attente d'acceptation du serveur
+        if (i % 256 == 255) poll_events(0);
+    }
+    freeaddrinfo(res);
+}
+
+// Le premier client de chaque groupe crée le salon, les autres le rejoignent ensuite
+void join_channels(void) {
+    char name[INFOS_LEN];
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < config.clients; i++) {
+            int creator = i % config.group == 0;
+            if (creator != (pass == 0)) continue;
+            clients[i].channel = i / config.group;
+            clients[i].state = STATE_JOINING;
+            channel_name(clients[i].channel, name, sizeof(name));
+            send_command(&clients[i], creator ? MULTICAST_CREATE : MULTICAST_JOIN, name);
+        }
+        wait_for_replies(pass == 0 ? "creating channels" : "joining channels");
+    }
+}
+
+// Charge
+int channel_size(int channel) {
+    int first = channel * config.group;
+    int last = first + config.group;
+    if (last > config.clients) last = config.clients;
+    return last - first;
+}
+
+int pick_kind(void) {
+    int total = config.mix[0] + config.mix[1] + config.mix[2];
+    int draw = (int)(rng_next() % total);
+    if (draw < config.mix[0]) return KIND_UNICAST;
+    if (draw < config.mix[0] + config.mix[1]) return KIND_BROADCAST;
+    return KIND_CHANNEL;
+}
+
+// sent_at est l'instant où l'envoi était prévu, pas celui où il a eu lieu
+void send_one(uint64_t sent_at) {
+    BenchClient *sender = &clients[rng_next() % config.clients];
+    int kind = pick_kind();
+    if (kind == KIND_CHANNEL && (sender->channel < 0 || channel_size(sender->channel) < 2)) {
+        kind = KIND_UNICAST;
+    }
+
+    char payload[MSG_LEN];
+    int len = snprintf(payload, sizeof(payload), BENCH_MAGIC "%016llx ", (unsigned long long)sent_at);
+    while (len < config.payload_size) payload[len++] = 'x';
+    payload[len] = '\0';
+
+    struct message msg = {0};
+    strncpy(msg.nick_sender, sender->nickname, NICK_LEN - 1);
+    msg.pld_len = len;
+
+    switch (kind) {
+        case KIND_UNICAST: {
+            int target = (int)(rng_next() % (config.clients - 1));
+            if (target >= sender->index) target++;
+            msg.type = UNICAST_SEND;
+            strncpy(msg.infos, clients[target].nickname, INFOS_LEN - 1);
+            expected++;
+            break;
+        }
+        case KIND_BROADCAST:
+            msg.type = BROADCAST_SEND;
+            expected += config.clients - 1;
+            break;
+        case KIND_CHANNEL:
+            msg.type = MULTICAST_SEND;
+            channel_name(sender->channel, msg.infos, INFOS_LEN);
+            expected += channel_size(sender->channel) - 1;
+            break;
+    }
+    sent_by_kind[kind]++;
+    send_frame(sender, &msg, payload);
+}
+
+// Retourne la durée effective de la phase d'envoi, en secondes
+double run_load(void) {
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t)(config.duration * 1e9);
+    uint64_t sent = 0;
+    double interval = 1e9 / config.rate;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end) break;
+
+        // Rattraper les envois prévus jusqu'à maintenant
+        while (sent < (uint64_t)((now - start) / interval)) {
+            send_one(start + (uint64_t)(sent * interval));
+            sent++;
+        }
+        poll_events(1);
+    }
+    double send_elapsed = (now_ns() - start) / 1e9;
+
+    // Laisser arriver les messages encore en route
+    uint64_t deadline = now_ns() + DRAIN_TIMEOUT * 1000000000ULL;
+    while (delivered < expected && now_ns() < deadline) {
+        poll_events(10);
+    }
+    return send_elapsed;
+}
+
+// Le débit de livraison est compté jusqu'à la dernière trame reçue, vidange comprise
+void report(double send_elapsed, double elapsed) {
+    uint64_t sent = sent_by_kind[0] + sent_by_kind[1] + sent_by_kind[2];
+    printf("clients      %d (%d channels of %d)\n", config.clients,
+           config.group ? (config.clients + config.group - 1) / config.group : 0, config.group);
+    printf("sent         %llu in %.1f s (%.0f msg/s): %llu unicast, %llu broadcast, %llu channel\n",
+           (unsigned long long)sent, send_elapsed, sent / send_elapsed,
+           (unsigned long long)sent_by_kind[KIND_UNICAST],
+           (unsigned long long)sent_by_kind[KIND_BROADCAST],
+           (unsigned long long)sent_by_kind[KIND_CHANNEL]);
+    printf("delivered    %llu of %llu in %.1f s (%.0f msg/s)\n",
+           (unsigned long long)delivered, (unsigned long long)expected, elapsed, delivered / elapsed);
+    printf("latency      p50 %.1f us  p99 %.1f us  p999 %.1f us  max %.1f us\n",
+           hist_percentile(&latency, 50) / 1e3, hist_percentile(&latency, 99) / 1e3,
+           hist_percentile(&latency, 99.9) / 1e3, counter_get(&latency.max) / 1e3);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c clients] [-r rate] [-d seconds] [-m unicast:broadcast:channel]\n"
+            "          [-g group] [-s payload] [-V 1|2|3] <server_name> <server_port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:d:m:g:s:V:")) != -1) {
+        switch (opt) {
+            case 'c':
+                config.clients = atoi(optarg);
+                break;
+            case 'r':
+                config.rate = atof(optarg);
+                break;
+            case 'd':
+                config.duration = atof(optarg);
+                break;
+            case 'm':
+                if (sscanf(optarg, "%d:%d:%d", &config.mix[0], &config.mix[1], &config.mix[2]) != 3) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'g':
+                config.group = atoi(optarg);
+                break;
+            case 's':
+                config.payload_size = atoi(optarg);
+                break;
+            case 'V':
+                config.wire_version = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2) usage(argv[0]);
+
+    if (config.clients < 2 || config.rate <= 0 || config.duration <= 0 ||
+        config.mix[0] < 0 || config.mix[1] < 0 || config.mix[2] < 0 ||
+        config.mix[0] + config.mix[1] + config.mix[2] == 0 || config.group < 0 ||
+        config.wire_version < WIRE_LEGACY || config.wire_version > WIRE_VERSION) {
+        usage(argv[0]);
+    }
+    if (config.payload_size < 20) config.payload_size = 20;
+    if (config.payload_size > MSG_LEN - 1) config.payload_size = MSG_LEN - 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+
+    clients = calloc(config.clients, sizeof(BenchClient));
+    epfd = epoll_create1(0);
+    if (!clients || epfd == -1) {
+        perror("setup");
+        exit(EXIT_FAILURE);
+    }
+
+    connect_clients(argv[optind], argv[optind + 1]);
+    wait_for_replies("registering nicknames");
+    if (config.group > 0) {
+        join_channels();
+    }
+    printf("%d clients ready, sending for %.1f s at %.0f msg/s\n",
+           config.clients, config.duration, config.rate);
+
+    uint64_t start = now_ns();
+    double send_elapsed = run_load();
+    report(send_elapsed, (now_ns() - start) / 1e9);
+
+    for (int i = 0; i < config.clients; i++) {
+        close(clients[i].fd);
+    }
+    close(epfd);
+    return EXIT_SUCCESS;
+}
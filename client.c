@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -10,55 +11,183 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/sendfile.h>
+#include <endian.h>
 #include "msg_struct.h"
 #include "common.h"
+#include "wire.h"
+#include "crc32c.h"
 
-static char saved_filepath[FILE_PATH_LEN];
+#define HELLO_TIMEOUT 1000
+#define SPLICE_CHUNK (1 << 20)
+#define SPLICE_PIPE_SIZE (1 << 20)
+#define COPY_BUF_SIZE (256 * 1024)
+#define MAX_TRANSFERS 16
+#define TRANSFER_STEP (4 << 20)  // Octets au plus par réveil : le chat reste servi
+#define TRANSFER_CHUNK (1 << 20)  // Granularité de la vérification et de la reprise
+
+static int wire_version = WIRE_LEGACY;  // Format de trame négocié avec le serveur
+static WireBuffer in_buffer;            // Données reçues du serveur pas encore traitées
+static struct sockaddr_in relay_addr;   // Relais de fichiers du serveur, port 0 s'il n'en a pas
+static int prefer_relay = 0;            // -r : fichiers reçus toujours par le relais
+static int want_compression = 0;        // -z : propose WIRE_DEFLATE au serveur
+
+// Chaque transfert est une machine à états menée par la boucle poll() du
+// client : plusieurs transferts avancent en parallèle, dans les deux sens,
+// sans bloquer le chat.
+//
+// Sur la connexion de données :
+//   émetteur -> HELLO   u32 magic, u32 taille de bloc, u64 taille, i64 mtime
+//   récepteur -> RESUME u64 offset déjà vérifié (0 pour un nouveau fichier)
+//   émetteur -> blocs   données puis u32 CRC-32C, depuis l'offset de reprise
+//   récepteur -> DONE   un octet, une fois le dernier bloc vérifié
+// Entiers en gros-boutiste. Le récepteur écrit dans ./inbox/<nom>.part et
+// note dans ./inbox/<nom>.resume l'offset vérifié : un nouvel envoi du même
+// fichier (même taille, même mtime) reprend à cet offset.
+//
+// En mode relais, chaque pair se connecte au relais du serveur et envoie
+// d'abord "<jeton>\n" ; la suite est identique.
+typedef enum {
+    XFER_FREE,
+    XFER_REQUESTED,   // Envoi : FILE_REQUEST parti, réponse attendue
+    XFER_PROMPTED,    // Réception : en attente de la réponse Y/N de l'utilisateur
+    XFER_LISTENING,   // Réception : FILE_ACCEPT parti, connexion du pair attendue
+    XFER_RELAY_WAIT,  // Réception : "relay" accepté, jeton du serveur attendu
+    XFER_CONNECTING,  // Envoi : connect() non bloquant en cours
+    XFER_HANDSHAKE,   // Jeton du relais éventuel, HELLO puis RESUME
+    XFER_SENDING,
+    XFER_RECEIVING,
+    XFER_FINISHING    // DONE attendu (envoi) ou à envoyer (réception)
+} TransferState;
+
+// Fichier local de reprise, écrit après chaque bloc vérifié
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t verified;
+} ResumeRecord;
 
-// Structure globale pour le transfert de fichiers
 typedef struct {
-    char filename[FILE_PATH_LEN];
-    char sender[NICK_LEN];
-    char receiver[NICK_LEN];
-    int transfer_socket;
-    int listening;
+    TransferState state;
+    int outgoing;                  // 1 pour un envoi
+    char filename[FILE_PATH_LEN];  // Nom annoncé au pair
+    char path[PATH_MAX];           // Fichier local (.part en réception)
+    char peer[NICK_LEN];           // "#" : fichier envoyé à tout le salon
+    char channel[INFOS_LEN];       // Réception : "#<salon>" pour un fichier de salon
+    char relay_token[RELAY_TOKEN_LEN + 1];  // Transfert relayé : jeton à envoyer au relais
+    int sock;        // Socket d'écoute puis de données, -1 si aucune
+    int file_fd;
+    int resume_fd;   // Réception : fichier .resume
+    int pipefd[2];   // Réception par splice()
+    off_t offset;    // Octets déjà transférés (envoyés ou écrits)
+    off_t size;      // Taille annoncée du fichier
+    int64_t mtime;
+    size_t chunk_size;    // Taille des blocs, annoncée par l'émetteur
+    off_t resumed;   // Offset de reprise : octets non transférés cette fois
+    off_t chunk_start;
+    size_t chunk_left;    // Octets du bloc courant restant à transférer
+    uint32_t chunk_crc;   // Envoi : somme du bloc courant
+    unsigned char ctl[TRANSFER_HELLO_LEN];  // Message de contrôle en cours
+    int ctl_len;          // 0 si aucun
+    int ctl_done;
+    int ctl_out;          // 1 : à envoyer, 0 : à recevoir
+    int copy;        // sendfile()/splice() refusés : repli par copie
+    char *buffer;    // Tampon du repli par copie et des sommes de contrôle
+    unsigned long prompt_seq;  // Ordre des questions Y/N
+    struct timespec start;
 } FileTransfer;
 
+static FileTransfer transfers[MAX_TRANSFERS];
+static unsigned long next_prompt_seq = 1;
+
+// /who et /channel_list : le serveur répond par pages (voir list_send() dans
+// server.c) ; la page suivante est demandée dès réception du curseur
+typedef struct {
+    enum msg_type type;
+    const char *title;
+    char prefix[NICK_LEN];  // Filtre de la commande, repris pour chaque page
+    int started;            // Titre déjà affiché
+} ListQuery;
 
-void handle_file_request(int sockfd, const char *sender, const char *filename);
+static ListQuery who_query = { .type = NICKNAME_LIST, .title = "Online users:" };
+static ListQuery channel_query = { .type = MULTICAST_LIST, .title = "Available channels:" };
+
+void handle_file_request(const char *sender, const char *filename, const char *target);
 void handle_file_send(const char *nickname, const char *filepath, int sockfd);
 void handle_file_response(struct message *msg, const char *payload);
-void setup_file_receiver(FileTransfer *transfer);
+int answer_file_request(int sockfd, const char *answer);
+short transfer_poll_events(FileTransfer *transfer);
+void transfer_event(int sockfd, FileTransfer *transfer);
+void transfer_free(FileTransfer *transfer);
+void transfer_connect(FileTransfer *transfer, struct sockaddr_in *addr);
+void start_relayed_transfer(struct message *msg, const char *relay);
+FileTransfer *find_relay_wait(const char *peer, const char *filename);
 void send_message(int sockfd, struct message *msg, const char *payload);
+ssize_t fill_input(int sockfd);
+void handle_server_message(int sockfd, struct message *msg, const char *payload, char *nickname);
+void negotiate_protocol(int sockfd, char *nickname);
+void request_list(int sockfd, ListQuery *query, const char *after, const char *nickname);
+
+// Transfert de fichiers : les octets passent du fichier à la socket (et
+// de la socket au fichier) dans le noyau, sans copie en espace utilisateur
+double elapsed_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void report_throughput(const char *what, size_t bytes, double seconds) {
+    if (seconds <= 0) seconds = 1e-9;
+    printf("File %s successfully (%zu bytes in %.2f s, %.1f MB/s)\n",
+           what, bytes, seconds, bytes / seconds / 1e6);
+}
 
+// La trame est encodée d'un bloc puis envoyée en un seul appel
 void send_message(int sockfd, struct message *msg, const char *payload) {
-    if (send(sockfd, msg, sizeof(struct message), 0) == -1) {
-        perror("send() message struct");
-        return;
-    }
-    if (msg->pld_len > 0 && payload != NULL) {
-        if (send(sockfd, payload, msg->pld_len, 0) == -1) {
-            perror("send() payload");
+    unsigned char frame[WIRE_MAX_FRAME];
+    if (msg->pld_len >= MSG_LEN) msg->pld_len = MSG_LEN - 1;
+    size_t len = wire_encode(wire_version, msg, payload, frame);
+
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t ret = send(sockfd, frame + sent, len - sent, 0);
+        if (ret == -1) {
+            perror("send() message");
             return;
         }
+        sent += ret;
     }
 }
 
+// Une seule lecture par réveil ; retourne le nombre d'octets lus,
+// 0 si le serveur a fermé et -1 en cas d'erreur
+ssize_t fill_input(int sockfd) {
+    wire_buffer_compact(&in_buffer);
+    ssize_t rec = recv(sockfd, in_buffer.data + in_buffer.end, WIRE_BUF_SIZE - in_buffer.end, 0);
+    if (rec > 0) in_buffer.end += rec;
+    return rec;
+}
+
 void handle_user_input(int sockfd, char *buffer, char *nickname) {
     struct message msg = {0};
     char payload[MSG_LEN] = {0};
     
+    // Réponse Y/N à une demande de transfert en attente
+    if (answer_file_request(sockfd, buffer)) return;
+
     if (strncmp(buffer, "/nick ", 6) == 0) {
         msg.type = NICKNAME_NEW;
         strncpy(msg.infos, buffer + 6, INFOS_LEN - 1);
         msg.pld_len = 0;
         strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
     } 
-    else if (strcmp(buffer, "/who") == 0) {
-        msg.type = NICKNAME_LIST;
-        msg.infos[0] = '\0';
-        msg.pld_len = 0;
-        strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
+    else if (strcmp(buffer, "/who") == 0 || strncmp(buffer, "/who ", 5) == 0) {
+        snprintf(who_query.prefix, NICK_LEN, "%s", buffer[4] ? buffer + 5 : "");
+        who_query.started = 0;
+        request_list(sockfd, &who_query, "", nickname);
+        return;
     } 
     else if (strncmp(buffer, "/whois ", 7) == 0) {
         msg.type = NICKNAME_INFOS;
@@ -95,11 +224,11 @@ void handle_user_input(int sockfd, char *buffer, char *nickname) {
         msg.pld_len = 0;
         strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
     }
-    else if (strcmp(buffer, "/channel_list") == 0) {
-        msg.type = MULTICAST_LIST;
-        msg.infos[0] = '\0';
-        msg.pld_len = 0;
-        strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
+    else if (strcmp(buffer, "/channel_list") == 0 || strncmp(buffer, "/channel_list ", 14) == 0) {
+        snprintf(channel_query.prefix, NICK_LEN, "%s", buffer[13] ? buffer + 14 : "");
+        channel_query.started = 0;
+        request_list(sockfd, &channel_query, "", nickname);
+        return;
     }
     else if (strncmp(buffer, "/join ", 6) == 0) {
         msg.type = MULTICAST_JOIN;
@@ -113,6 +242,12 @@ void handle_user_input(int sockfd, char *buffer, char *nickname) {
         msg.pld_len = 0;
         strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
     }
+    else if (strcmp(buffer, "/stats") == 0) {
+        msg.type = STATS_QUERY;
+        msg.infos[0] = '\0';
+        msg.pld_len = 0;
+        strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
+    }
     else if (strncmp(buffer, "/send ", 6) == 0) {
         char *space = strchr(buffer + 6, ' ');
         if (space) {
@@ -129,6 +264,18 @@ void handle_user_input(int sockfd, char *buffer, char *nickname) {
         } else {
             printf("Usage: /send <nickname> <filepath>\n");
         }
+        return;
+    }
+    else if (strncmp(buffer, "/sendchan ", 10) == 0) {
+        // Le serveur reçoit le fichier une fois et le propose à tout le salon
+        char *filepath = buffer + 10;
+        if (filepath[0] == '"') {
+            filepath++;
+            char *end_quote = strchr(filepath, '"');
+            if (end_quote) *end_quote = '\0';
+        }
+        handle_file_send("#", filepath, sockfd);
+        return;
     }
     else {
         msg.type = MULTICAST_SEND;
@@ -142,7 +289,8 @@ void handle_user_input(int sockfd, char *buffer, char *nickname) {
 }
 
 void echo_client(int sockfd) {
-    struct pollfd fds[2];
+    struct pollfd fds[2 + MAX_TRANSFERS];
+    FileTransfer *fd_transfer[2 + MAX_TRANSFERS];
     char buffer[MSG_LEN];
     char nickname[NICK_LEN] = {0};
     
@@ -151,8 +299,21 @@ void echo_client(int sockfd) {
     fds[1].fd = sockfd;
     fds[1].events = POLLIN;
 
+    negotiate_protocol(sockfd, nickname);
+
     while (1) {
-        int poll_ret = poll(fds, 2, -1);
+        // Les transferts en cours ajoutent leur socket à l'ensemble surveillé
+        int nfds = 2;
+        for (int i = 0; i < MAX_TRANSFERS; i++) {
+            short events = transfer_poll_events(&transfers[i]);
+            if (!events) continue;
+            fds[nfds].fd = transfers[i].sock;
+            fds[nfds].events = events;
+            fd_transfer[nfds] = &transfers[i];
+            nfds++;
+        }
+
+        int poll_ret = poll(fds, nfds, -1);
         if (poll_ret < 0) {
             perror("poll()");
             break;
@@ -175,76 +336,162 @@ void echo_client(int sockfd) {
         }
 
         if (fds[1].revents & POLLIN) {
-            struct message msg = {0};
-            char payload[MSG_LEN] = {0};
-            
-            ssize_t rec = recv(sockfd, &msg, sizeof(struct message), 0);
+            ssize_t rec = fill_input(sockfd);
             if (rec <= 0) {
                 if (rec == 0) printf("Server disconnected\n");
-                else perror("recv() message struct");
+                else perror("recv()");
                 break;
             }
 
-            if (msg.pld_len > 0) {
-                if (recv(sockfd, payload, msg.pld_len, 0) <= 0) {
-                    perror("recv() payload");
-                    break;
-                }
-                payload[msg.pld_len] = '\0';
+            struct message msg;
+            char payload[MSG_LEN];
+            int ret;
+            while ((ret = wire_buffer_next(&in_buffer, wire_version, &msg, payload)) > 0) {
+                handle_server_message(sockfd, &msg, payload, nickname);
+            }
+            if (ret < 0) {
+                fprintf(stderr, "Malformed frame from server\n");
+                break;
+            }
+        }
+
+        for (int i = 2; i < nfds; i++) {
+            if (fds[i].revents) transfer_event(sockfd, fd_transfer[i]);
+        }
+    }
+
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (transfers[i].state != XFER_FREE) transfer_free(&transfers[i]);
+    }
+}
+
+void request_list(int sockfd, ListQuery *query, const char *after, const char *nickname) {
+    struct message msg = {0};
+    msg.type = query->type;
+    strncpy(msg.nick_sender, nickname, NICK_LEN - 1);
+    int len = 0;
+    if (query->prefix[0]) len += snprintf(msg.infos, INFOS_LEN, "prefix=%.50s ", query->prefix);
+    if (after[0]) snprintf(msg.infos + len, INFOS_LEN - len, "after=%.60s", after);
+    send_message(sockfd, &msg, NULL);
+}
+
+// Une trame de liste paginée ; retourne 0 si elle vient d'un ancien serveur
+int handle_list_page(int sockfd, ListQuery *query, struct message *msg, const char *payload,
+                     const char *nickname) {
+    int last = strcmp(msg->infos, "end") == 0;
+    int next = strncmp(msg->infos, "next=", 5) == 0;
+    if (!last && !next && strcmp(msg->infos, "more") != 0) return 0;
+
+    if (!query->started) {
+        printf("%s\n", query->title);
+        query->started = 1;
+    }
+    if (msg->pld_len > 0) fputs(payload, stdout);
+    if (next) request_list(sockfd, query, msg->infos + 5, nickname);
+    if (last) query->started = 0;
+    return 1;
+}
+
+void handle_server_message(int sockfd, struct message *msg, const char *payload, char *nickname) {
+    switch (msg->type) {
+        case NICKNAME_NEW:
+            if (msg->infos[0] != '\0') {
+                strncpy(nickname, msg->infos, NICK_LEN - 1);
+                printf("Welcome on the chat %s\n", nickname);
+            } else {
+                printf("Nickname change failed\n");
             }
+            break;
+            
+        case NICKNAME_LIST:
+            if (!handle_list_page(sockfd, &who_query, msg, payload, nickname)) {
+                printf("%s\n", msg->infos);
+            }
+            break;
 
-            switch (msg.type) {
-                case NICKNAME_NEW:
-                    if (msg.infos[0] != '\0') {
-                        strncpy(nickname, msg.infos, NICK_LEN - 1);
-                        printf("Welcome on the chat %s\n", nickname);
-                    } else {
-                        printf("Nickname change failed\n");
-                    }
-                    break;
-                    
-                case NICKNAME_LIST:
-                case NICKNAME_INFOS:
-                    printf("%s\n", msg.infos);
-                    break;
-                    
-                case ECHO_SEND:
-                    // Message d'erreur du serveur ou message d'information
-                    printf("[%s]: %s\n", msg.nick_sender, msg.infos);
-                    break;
+        case MULTICAST_LIST:
+            handle_list_page(sockfd, &channel_query, msg, payload, nickname);
+            break;
 
-                case UNICAST_SEND:
-                case BROADCAST_SEND:
-                case MULTICAST_SEND:
-                    if (msg.pld_len > 0) {
-                        printf("[%s]: %s\n", msg.nick_sender, payload);
-                    } else {
-                        printf("[%s]: %s\n", msg.nick_sender, msg.infos);
-                    }
-                    break;
+        case NICKNAME_INFOS:
+            printf("%s\n", msg->infos);
+            break;
+            
+        case ECHO_SEND:
+            // Message d'erreur du serveur ou message d'information
+            printf("[%s]: %s\n", msg->nick_sender, msg->infos);
+            break;
 
-                case FILE_REQUEST:
-                    handle_file_request(sockfd, msg.nick_sender, payload);
-                    break;
+        case UNICAST_SEND:
+        case BROADCAST_SEND:
+        case MULTICAST_SEND:
+            if (msg->pld_len > 0) {
+                printf("[%s]: %s\n", msg->nick_sender, payload);
+            } else {
+                printf("[%s]: %s\n", msg->nick_sender, msg->infos);
+            }
+            break;
 
-                case FILE_ACCEPT:
-                    handle_file_response(&msg, payload);
-                    break;
+        case FILE_REQUEST:
+            handle_file_request(msg->nick_sender, payload, msg->infos);
+            break;
 
-                case FILE_REJECT:
-                    printf("%s refused the file transfer. (%s)\n", msg.nick_sender, msg_type_str[13]);
-                    break;
+        case FILE_ACCEPT:
+            handle_file_response(msg, payload);
+            break;
 
-                case FILE_ACK:
-                    printf("%s has received the file.\n", msg.nick_sender);
-                    break;
-                    
-                default:
-                    if (msg.infos[0] != '\0') {
-                        printf("[%s]: %s\n", msg.nick_sender, msg.infos);
-                    }
-                    break;
+        case FILE_REJECT:
+            handle_file_response(msg, payload);
+            break;
+
+        case FILE_ACK:
+            if (msg->pld_len > 0) printf("%s has received %s.\n", msg->nick_sender, payload);
+            else printf("%s has received the file.\n", msg->nick_sender);
+            break;
+
+        case STATS_QUERY:
+            printf("%s", msg->pld_len > 0 ? payload : msg->infos);
+            if (msg->pld_len == 0) printf("\n");
+            break;
+            
+        default:
+            if (msg->infos[0] != '\0') {
+                printf("[%s]: %s\n", msg->nick_sender, msg->infos);
+            }
+            break;
+    }
+}
+
+// Propose le format compact au serveur ; un ancien serveur ne répond pas
+// PROTO_HELLO et la connexion reste en WIRE_LEGACY
+void negotiate_protocol(int sockfd, char *nickname) {
+    struct message hello = {0};
+    hello.type = PROTO_HELLO;
+    snprintf(hello.infos, INFOS_LEN, "%d", want_compression ? WIRE_DEFLATE : WIRE_V2);
+    send_message(sockfd, &hello, NULL);
+
+    // Les trames qui suivent la réponse restent dans in_buffer et seront
+    // décodées au nouveau format par la boucle principale
+    struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+    while (poll(&pfd, 1, HELLO_TIMEOUT) > 0) {
+        if (fill_input(sockfd) <= 0) return;
+
+        struct message msg;
+        char payload[MSG_LEN];
+        while (wire_buffer_next(&in_buffer, wire_version, &msg, payload) > 0) {
+            if (msg.type == PROTO_HELLO) {
+                int version = atoi(msg.infos);
+                wire_version = version >= WIRE_V2 && version <= WIRE_VERSION ? version : WIRE_LEGACY;
+
+                // Relais de fichiers éventuel, sur l'adresse du serveur
+                const char *relay = strstr(msg.infos, "relay=");
+                socklen_t addr_len = sizeof(relay_addr);
+                if (relay && getpeername(sockfd, (struct sockaddr *)&relay_addr, &addr_len) == 0) {
+                    relay_addr.sin_port = htons(atoi(relay + 6));
+                }
+                return;
             }
+            handle_server_message(sockfd, &msg, payload, nickname);
         }
     }
 }
@@ -286,101 +533,163 @@ int handle_connect(const char *server_name, const char *server_port) {
     return sockfd;
 }
 
-void setup_file_receiver(FileTransfer *transfer) {
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("socket() for file transfer");
-        return;
+FileTransfer *transfer_alloc(TransferState state, const char *peer, const char *filename) {
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        FileTransfer *transfer = &transfers[i];
+        if (transfer->state != XFER_FREE) continue;
+
+        memset(transfer, 0, sizeof(FileTransfer));
+        transfer->state = state;
+        transfer->sock = -1;
+        transfer->file_fd = -1;
+        transfer->resume_fd = -1;
+        transfer->pipefd[0] = transfer->pipefd[1] = -1;
+        strncpy(transfer->peer, peer, NICK_LEN - 1);
+        strncpy(transfer->filename, filename, FILE_PATH_LEN - 1);
+        return transfer;
     }
-    
-    struct sockaddr_in addr = {0};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(FILE_PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
-    
-    if (bind(server_socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("bind() for file transfer");
-        close(server_socket);
+    printf("Error: Too many file transfers in progress (max %d)\n", MAX_TRANSFERS);
+    return NULL;
+}
+
+void transfer_free(FileTransfer *transfer) {
+    if (transfer->sock >= 0) close(transfer->sock);
+    if (transfer->file_fd >= 0) close(transfer->file_fd);
+    if (transfer->resume_fd >= 0) close(transfer->resume_fd);
+    if (transfer->pipefd[0] >= 0) close(transfer->pipefd[0]);
+    if (transfer->pipefd[1] >= 0) close(transfer->pipefd[1]);
+    free(transfer->buffer);
+    transfer->state = XFER_FREE;
+}
+
+void transfer_fail(FileTransfer *transfer, const char *what) {
+    if (what) perror(what);
+    printf("File transfer of %s with %s failed\n", transfer->filename, transfer->peer);
+    if (!transfer->outgoing && transfer->resume_fd >= 0 && transfer->chunk_start > 0) {
+        printf("%lld bytes verified are kept in %s, the next transfer of this file will resume from there\n",
+               (long long)transfer->chunk_start, transfer->path);
+    }
+    transfer_free(transfer);
+}
+
+// Les réponses Y/N s'appliquent aux demandes dans leur ordre d'arrivée
+FileTransfer *oldest_prompt(void) {
+    FileTransfer *oldest = NULL;
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        if (transfers[i].state == XFER_PROMPTED &&
+            (!oldest || transfers[i].prompt_seq < oldest->prompt_seq)) {
+            oldest = &transfers[i];
+        }
+    }
+    return oldest;
+}
+
+void show_prompt(FileTransfer *transfer) {
+    if (transfer->channel[0] != '\0') {
+        printf("%s sends the file named \"%s\" to channel %s. Do you accept? [Y/N]\n",
+               transfer->peer, transfer->filename, transfer->channel + 1);
         return;
     }
-    
-    if (listen(server_socket, 1) < 0) {
-        perror("listen() for file transfer");
-        close(server_socket);
+    printf("%s wants you to accept the transfer of the file named \"%s\". Do you accept? [Y/N]\n",
+           transfer->peer, transfer->filename);
+}
+
+// Le nom vient du pair : seul le dernier composant est gardé, et jamais ".."
+int is_safe_filename(const char *filename) {
+    return filename[0] != '\0' && strchr(filename, '/') == NULL &&
+           strcmp(filename, ".") != 0 && strcmp(filename, "..") != 0;
+}
+
+// target vaut "#<salon>" quand le fichier est proposé à tout le salon
+void handle_file_request(const char *sender, const char *filename, const char *target) {
+    if (!is_safe_filename(filename)) {
+        printf("%s sent a file request with an invalid name, ignored\n", sender);
         return;
     }
-    
-    transfer->transfer_socket = server_socket;
-    transfer->listening = 1;
+
+    FileTransfer *transfer = transfer_alloc(XFER_PROMPTED, sender, filename);
+    if (!transfer) return;
+    transfer->prompt_seq = next_prompt_seq++;
+    if (target[0] == '#') strncpy(transfer->channel, target, INFOS_LEN - 1);
+
+    // Une seule question affichée à la fois ; les suivantes attendent leur tour
+    if (oldest_prompt() == transfer) show_prompt(transfer);
 }
 
-void handle_file_request(int sockfd, const char *sender, const char *filename) {
-    printf("%s wants you to accept the transfer of the file named \"%s\". Do you accept? [Y/N]\n", 
-           sender, filename);
-    
-    char response;
-    scanf(" %c", &response);
-    
+// Socket d'écoute sur un port éphémère, sur l'interface qui joint le serveur
+int open_transfer_listener(int sockfd, char *endpoint, size_t size) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(sockfd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("getsockname()");
+        return -1;
+    }
+    addr.sin_port = 0;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd < 0) {
+        perror("socket() for file transfer");
+        return -1;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, 1) < 0 ||
+        getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        perror("bind() for file transfer");
+        close(listen_fd);
+        return -1;
+    }
+
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    snprintf(endpoint, size, "%s:%d", ip, ntohs(addr.sin_port));
+    return listen_fd;
+}
+
+// Retourne 1 si la ligne était une réponse à une demande de transfert
+int answer_file_request(int sockfd, const char *answer) {
+    FileTransfer *transfer = oldest_prompt();
+    if (!transfer || strlen(answer) != 1 || !strchr("YyNn", answer[0])) return 0;
+
     struct message msg = {0};
-    msg.type = (response == 'Y' || response == 'y') ? FILE_ACCEPT : FILE_REJECT;
-    strncpy(msg.infos, sender, NICK_LEN);
-    
-    if (msg.type == FILE_ACCEPT) {
-        FileTransfer transfer = {0};
-        strncpy(transfer.filename, filename, FILE_PATH_LEN);
-        strncpy(transfer.sender, sender, NICK_LEN);
-        setup_file_receiver(&transfer);
-        char payload[MSG_LEN];
-        snprintf(payload, MSG_LEN, "127.0.0.1:%d", FILE_PORT);
-        msg.pld_len = strlen(payload) + 1;
-        
-        send_message(sockfd, &msg, payload);
-        
-        struct sockaddr_in sender_addr;
-        socklen_t addr_len = sizeof(sender_addr);
-        printf("Waiting for file transfer connection...\n");
-        
-        int file_socket = accept(transfer.transfer_socket, 
-                               (struct sockaddr*)&sender_addr, &addr_len);
-        if (file_socket < 0) {
-            perror("accept() file transfer");
-            close(transfer.transfer_socket);
-            return;
+    strncpy(msg.infos, transfer->peer, INFOS_LEN - 1);
+    char payload[MSG_LEN];
+
+    int accept = answer[0] == 'Y' || answer[0] == 'y';
+    if (accept) {
+        // Le relais sert quand il est demandé (-r) ou quand l'écoute locale
+        // échoue ; un fichier de salon n'est servi que par le relais
+        char endpoint[64];
+        if (transfer->channel[0] == '\0' && (!prefer_relay || relay_addr.sin_port == 0)) {
+            transfer->sock = open_transfer_listener(sockfd, endpoint, sizeof(endpoint));
         }
-        system("mkdir -p ./inbox");
-        char file_path[FILE_PATH_LEN];
-        snprintf(file_path, FILE_PATH_LEN, "./inbox/%s", filename);
-        FILE *fp = fopen(file_path, "wb");
-        if (!fp) {
-            perror("fopen() for received file");
-            close(file_socket);
-            close(transfer.transfer_socket);
-            return;
+        if (transfer->sock >= 0) {
+            // Le nom du fichier suit l'adresse : l'émetteur retrouve sa demande
+            snprintf(payload, MSG_LEN, "%s %s", endpoint, transfer->filename);
+            transfer->state = XFER_LISTENING;
+            printf("Waiting for file transfer connection...\n");
+        } else if (relay_addr.sin_port != 0) {
+            snprintf(payload, MSG_LEN, "relay %s", transfer->filename);
+            transfer->state = XFER_RELAY_WAIT;
+            printf("Waiting for the server relay...\n");
+        } else {
+            accept = 0;
         }
-        
-        char buffer[4096];
-        ssize_t bytes_received;
-        while ((bytes_received = recv(file_socket, buffer, sizeof(buffer), 0)) > 0) {
-            fwrite(buffer, 1, bytes_received, fp);
-        }
-        
-        fclose(fp);
-        close(file_socket);
-        close(transfer.transfer_socket);
-        
-        msg.type = FILE_ACK;
-        msg.pld_len = 0;
-        strncpy(msg.infos, filename, INFOS_LEN);
-        send_message(sockfd, &msg, NULL);
-        
-        printf("File saved in ./inbox/%s\n", filename);
+    }
+
+    if (accept) {
+        msg.type = FILE_ACCEPT;
     } else {
-        // Envoyer le rejet
-        msg.pld_len = 0;
-        send_message(sockfd, &msg, NULL);
+        msg.type = FILE_REJECT;
+        snprintf(payload, MSG_LEN, "%s", transfer->filename);
+        transfer_free(transfer);
     }
-}
+    msg.pld_len = strlen(payload) + 1;
+    send_message(sockfd, &msg, payload);
 
+    FileTransfer *next = oldest_prompt();
+    if (next) show_prompt(next);
+    return 1;
+}
 
 void handle_file_send(const char *nickname, const char *filepath, int sockfd) {
     if (!nickname || !filepath || sockfd < 0) {
@@ -388,17 +697,28 @@ void handle_file_send(const char *nickname, const char *filepath, int sockfd) {
         return;
     }
 
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
+    const char *filename = strrchr(filepath, '/');
+    filename = filename ? filename + 1 : filepath;
+
+    int fd = open(filepath, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
         printf("Error: Cannot open file %s\n", filepath);
+        if (fd >= 0) close(fd);
         return;
     }
 
-    strncpy(saved_filepath, filepath, FILE_PATH_LEN - 1);
-    saved_filepath[FILE_PATH_LEN - 1] = '\0';
-
-    const char *filename = strrchr(filepath, '/');
-    filename = filename ? filename + 1 : filepath;
+    FileTransfer *transfer = transfer_alloc(XFER_REQUESTED, nickname, filename);
+    if (!transfer) {
+        close(fd);
+        return;
+    }
+    strncpy(transfer->path, filepath, PATH_MAX - 1);
+    transfer->outgoing = 1;
+    transfer->file_fd = fd;
+    transfer->size = st.st_size;
+    transfer->mtime = st.st_mtime;
+    transfer->chunk_size = TRANSFER_CHUNK;
 
     struct message msg = {0};
     msg.type = FILE_REQUEST;
@@ -406,9 +726,36 @@ void handle_file_send(const char *nickname, const char *filepath, int sockfd) {
     strncpy(msg.infos, nickname, INFOS_LEN - 1);
     msg.infos[INFOS_LEN - 1] = '\0';
     
-    fclose(fp);
     send_message(sockfd, &msg, filename);
-    printf("File transfer request sent for \"%s\" to %s\n", filename, nickname);
+    if (strcmp(nickname, "#") == 0) {
+        printf("File transfer request sent for \"%s\" to your channel\n", filename);
+    } else {
+        printf("File transfer request sent for \"%s\" to %s\n", filename, nickname);
+    }
+}
+
+// Demande en attente vers peer ; un ancien client ne renvoie pas le nom
+// du fichier et reçoit la plus ancienne
+FileTransfer *find_request(const char *peer, const char *filename) {
+    FileTransfer *found = NULL;
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        FileTransfer *transfer = &transfers[i];
+        if (transfer->state != XFER_REQUESTED || strcmp(transfer->peer, peer) != 0) continue;
+        if (filename && strcmp(transfer->filename, filename) == 0) return transfer;
+        if (!found) found = transfer;
+    }
+    return filename && *filename ? NULL : found;
+}
+
+FileTransfer *find_relay_wait(const char *peer, const char *filename) {
+    for (int i = 0; i < MAX_TRANSFERS; i++) {
+        FileTransfer *transfer = &transfers[i];
+        if (transfer->state == XFER_RELAY_WAIT && strcmp(transfer->peer, peer) == 0 &&
+            strcmp(transfer->filename, filename) == 0) {
+            return transfer;
+        }
+    }
+    return NULL;
 }
 
 void handle_file_response(struct message *msg, const char *payload) {
@@ -417,93 +764,620 @@ void handle_file_response(struct message *msg, const char *payload) {
         return;
     }
 
-    if (msg->type == FILE_ACCEPT) {
-        printf("%s accepted file transfer.\n", msg->infos);
-        
-        // Parser l'adresse et le port
-        char addr[16] = {0};
-        int port = 0;
-        if (sscanf(payload, "%15[^:]:%d", addr, &port) != 2) {
-            printf("Error: Invalid address format\n");
+    if (msg->type == FILE_REJECT) {
+        // Le serveur annule un transfert relayé qu'il ne peut pas prendre en charge
+        FileTransfer *waiting = msg->pld_len > 0 ? find_relay_wait(msg->infos, payload) : NULL;
+        if (waiting) {
+            printf("The server cannot relay %s, transfer cancelled\n", waiting->filename);
+            transfer_free(waiting);
             return;
         }
-        
-        printf("Connecting to %s and sending the file %s...\n", msg->infos, saved_filepath);
-        
-        // Créer le socket de transfert
-        int transfer_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (transfer_socket < 0) {
-            perror("socket() for file transfer");
-            return;
+
+        FileTransfer *transfer = find_request(msg->infos, msg->pld_len > 0 ? payload : NULL);
+        if (strcmp(msg->infos, "#") == 0) {
+            printf("The server refused to send the file to your channel.\n");
+        } else {
+            printf("%s refused the file transfer.\n", msg->infos);
         }
-        
-        // Configurer l'adresse de connexion
-        struct sockaddr_in receiver_addr = {0};
-        receiver_addr.sin_family = AF_INET;
-        receiver_addr.sin_port = htons(port);
-        if (inet_pton(AF_INET, addr, &receiver_addr.sin_addr) <= 0) {
-            printf("Error: Invalid address\n");
-            close(transfer_socket);
-            return;
+        if (transfer) transfer_free(transfer);
+        return;
+    }
+
+    if (strncmp(payload, "relay:", 6) == 0) {
+        start_relayed_transfer(msg, payload + 6);
+        return;
+    }
+
+    // Parser l'adresse, le port et le nom du fichier
+    char addr[16] = {0};
+    char filename[FILE_PATH_LEN] = {0};
+    int port = 0;
+    if (sscanf(payload, "%15[^:]:%d %255[^\n]", addr, &port, filename) < 2) {
+        printf("Error: Invalid address format\n");
+        return;
+    }
+
+    FileTransfer *transfer = find_request(msg->infos, filename[0] ? filename : NULL);
+    if (!transfer) {
+        printf("%s accepted a file transfer that was not requested\n", msg->infos);
+        return;
+    }
+    printf("%s accepted file transfer.\n", msg->infos);
+    printf("Connecting to %s and sending the file %s...\n", msg->infos, transfer->path);
+
+    struct sockaddr_in receiver_addr = {0};
+    receiver_addr.sin_family = AF_INET;
+    receiver_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &receiver_addr.sin_addr) <= 0) {
+        printf("Error: Invalid address\n");
+        transfer_free(transfer);
+        return;
+    }
+
+    transfer_connect(transfer, &receiver_addr);
+}
+
+// Les deux pairs d'un transfert relayé se connectent au serveur ; le
+// récepteur retrouve sa réponse en attente, l'émetteur sa demande
+void start_relayed_transfer(struct message *msg, const char *relay) {
+    char token[RELAY_TOKEN_LEN + 1] = {0};
+    char filename[FILE_PATH_LEN] = {0};
+    if (sscanf(relay, "%16[0-9a-f] %255[^\n]", token, filename) != 2 ||
+        strlen(token) != RELAY_TOKEN_LEN || relay_addr.sin_port == 0) {
+        printf("Error: Invalid relay information\n");
+        return;
+    }
+
+    FileTransfer *transfer = find_relay_wait(msg->infos, filename);
+    if (!transfer) transfer = find_request(msg->infos, filename);
+    if (!transfer) {
+        printf("%s accepted a file transfer that was not requested\n", msg->infos);
+        return;
+    }
+    if (transfer->outgoing && strcmp(transfer->peer, "#") == 0) {
+        printf("Uploading %s to the server for your channel...\n", transfer->filename);
+    } else if (transfer->outgoing) {
+        printf("%s accepted file transfer through the server relay.\n", msg->infos);
+    }
+    memcpy(transfer->relay_token, token, sizeof(token));
+    transfer_connect(transfer, &relay_addr);
+}
+
+// La connexion s'établit en arrière-plan ; POLLOUT signale la fin
+void transfer_connect(FileTransfer *transfer, struct sockaddr_in *addr) {
+    transfer->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (transfer->sock < 0) {
+        transfer_fail(transfer, "socket() for file transfer");
+        return;
+    }
+    if (connect(transfer->sock, (struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+        errno != EINPROGRESS) {
+        transfer_fail(transfer, "connect() for file transfer");
+        return;
+    }
+    transfer->state = XFER_CONNECTING;
+}
+
+// Événements poll() attendus pour un transfert, 0 s'il n'a pas de socket
+short transfer_poll_events(FileTransfer *transfer) {
+    switch (transfer->state) {
+        case XFER_LISTENING:
+        case XFER_RECEIVING:
+            return POLLIN;
+        case XFER_CONNECTING:
+        case XFER_SENDING:
+            return POLLOUT;
+        case XFER_HANDSHAKE:
+        case XFER_FINISHING:
+            return transfer->ctl_out ? POLLOUT : POLLIN;
+        default:
+            return 0;
+    }
+}
+
+int transfer_copy_buffer(FileTransfer *transfer) {
+    if (transfer->buffer) return 0;
+    transfer->buffer = malloc(COPY_BUF_SIZE);
+    if (!transfer->buffer) {
+        perror("malloc() file buffer");
+        return -1;
+    }
+    return 0;
+}
+
+// Prépare l'échange d'un message de contrôle de len octets dans ctl
+void transfer_ctl(FileTransfer *transfer, int out, int len) {
+    transfer->ctl_out = out;
+    transfer->ctl_len = len;
+    transfer->ctl_done = 0;
+}
+
+// Fait avancer le message de contrôle ; retourne 1 s'il est complet,
+// 0 s'il faut attendre la socket, -1 en cas d'erreur
+int transfer_ctl_step(FileTransfer *transfer) {
+    while (transfer->ctl_done < transfer->ctl_len) {
+        unsigned char *data = transfer->ctl + transfer->ctl_done;
+        size_t len = transfer->ctl_len - transfer->ctl_done;
+        ssize_t n = transfer->ctl_out ? send(transfer->sock, data, len, MSG_NOSIGNAL)
+                                      : recv(transfer->sock, data, len, 0);
+        if (n == 0) {
+            printf("Error: %s closed the file transfer connection\n", transfer->peer);
+            return -1;
         }
-        
-        // Se connecter au récepteur
-        if (connect(transfer_socket, (struct sockaddr*)&receiver_addr,
-                   sizeof(receiver_addr)) < 0) {
-            perror("connect() for file transfer");
-            close(transfer_socket);
-            return;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror(transfer->ctl_out ? "send() transfer control" : "recv() transfer control");
+            return -1;
         }
-        
-        // Ouvrir le fichier à envoyer
-        FILE *fp = fopen(saved_filepath, "rb");
-        if (!fp) {
-            printf("Error: Cannot open file %s for sending\n", saved_filepath);
-            close(transfer_socket);
-            return;
+        transfer->ctl_done += n;
+    }
+    return 1;
+}
+
+// CRC-32C d'une plage du fichier, relue depuis le cache de pages : les
+// données elles-mêmes ne passent toujours pas par l'espace utilisateur
+int checksum_range(FileTransfer *transfer, off_t offset, size_t len, uint32_t *crc) {
+    if (transfer_copy_buffer(transfer) == -1) return -1;
+    *crc = 0;
+    while (len > 0) {
+        size_t want = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+        ssize_t n = pread(transfer->file_fd, transfer->buffer, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) perror("pread() checksum");
+            else printf("Error: %s is shorter than announced\n", transfer->path);
+            return -1;
         }
-        
-        // Envoyer le fichier
-        char buffer[4096];
-        size_t bytes_read;
-        size_t total_sent = 0;
-        
-        while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-            size_t bytes_to_send = bytes_read;
-            size_t bytes_sent = 0;
-            
-            while (bytes_sent < bytes_to_send) {
-                ssize_t ret = send(transfer_socket,
-                                 buffer + bytes_sent,
-                                 bytes_to_send - bytes_sent,
-                                 0);
-                if (ret < 0) {
-                    perror("send() file data");
-                    fclose(fp);
-                    close(transfer_socket);
-                    return;
-                }
-                bytes_sent += ret;
+        *crc = crc32c_update(*crc, transfer->buffer, n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+size_t next_chunk_len(FileTransfer *transfer) {
+    off_t left = transfer->size - transfer->offset;
+    return left < (off_t)transfer->chunk_size ? (size_t)left : transfer->chunk_size;
+}
+
+void send_hello(FileTransfer *transfer) {
+    uint32_t magic = htobe32(TRANSFER_MAGIC);
+    uint32_t chunk = htobe32(transfer->chunk_size);
+    uint64_t size = htobe64(transfer->size);
+    uint64_t mtime = htobe64(transfer->mtime);
+    memcpy(transfer->ctl, &magic, 4);
+    memcpy(transfer->ctl + 4, &chunk, 4);
+    memcpy(transfer->ctl + 8, &size, 8);
+    memcpy(transfer->ctl + 16, &mtime, 8);
+    transfer_ctl(transfer, 1, TRANSFER_HELLO_LEN);
+}
+
+// Envoie au plus TRANSFER_STEP octets, chaque bloc suivi de sa somme ;
+// retourne 1 si tout est parti, 0 s'il faut attendre POLLOUT, -1 en cas d'erreur
+int send_file_step(FileTransfer *transfer) {
+    size_t budget = TRANSFER_STEP;
+    while (budget > 0) {
+        if (transfer->chunk_left == 0) {
+            // Somme du bloc précédent d'abord, puis le bloc suivant
+            if (transfer->ctl_len > 0) {
+                int ret = transfer_ctl_step(transfer);
+                if (ret <= 0) return ret;
+                transfer->ctl_len = 0;
+            }
+            if (transfer->offset >= transfer->size) return 1;
+
+            transfer->chunk_start = transfer->offset;
+            transfer->chunk_left = next_chunk_len(transfer);
+            if (checksum_range(transfer, transfer->chunk_start, transfer->chunk_left,
+                               &transfer->chunk_crc) == -1) {
+                return -1;
+            }
+        }
+
+        size_t len = transfer->chunk_left < budget ? transfer->chunk_left : budget;
+        ssize_t ret;
+        if (!transfer->copy) {
+            ret = sendfile(transfer->sock, transfer->file_fd, &transfer->offset, len);
+            if (ret < 0 && transfer->offset == transfer->resumed && (errno == EINVAL || errno == ENOSYS)) {
+                transfer->copy = 1;
+                continue;
+            }
+        } else {
+            // Lecture à l'offset courant : un envoi partiel relira la suite
+            if (len > COPY_BUF_SIZE) len = COPY_BUF_SIZE;
+            ssize_t bytes_read = pread(transfer->file_fd, transfer->buffer, len, transfer->offset);
+            if (bytes_read <= 0) {
+                if (bytes_read < 0) perror("pread() file data");
+                return -1;
             }
-            total_sent += bytes_sent;
+            ret = send(transfer->sock, transfer->buffer, bytes_read, MSG_NOSIGNAL);
+            if (ret > 0) transfer->offset += ret;
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("sendfile()");
+            return -1;
+        }
+        if (ret == 0) {
+            printf("Error: %s was truncated while sending\n", transfer->path);
+            return -1;
         }
-        
-        fclose(fp);
-        close(transfer_socket);
-        printf("File sent successfully (%zu bytes)\n", total_sent);
+        transfer->chunk_left -= ret;
+        budget -= ret < (ssize_t)budget ? ret : (ssize_t)budget;
+
+        if (transfer->chunk_left == 0) {
+            uint32_t crc = htobe32(transfer->chunk_crc);
+            memcpy(transfer->ctl, &crc, 4);
+            transfer_ctl(transfer, 1, 4);
+        }
+    }
+    return 0;
+}
+
+void resume_path(FileTransfer *transfer, char *path, size_t size) {
+    snprintf(path, size, "./inbox/%s.resume", transfer->filename);
+}
+
+// Note l'offset vérifié ; sans fsync : après une panne, le pire est de
+// renvoyer les derniers blocs, jamais d'accepter un bloc non vérifié
+void save_resume(FileTransfer *transfer) {
+    ResumeRecord record = { transfer->size, transfer->mtime, transfer->chunk_start };
+    if (pwrite(transfer->resume_fd, &record, sizeof(record), 0) != sizeof(record)) {
+        perror("pwrite() resume record");
+    }
+}
+
+// HELLO reçu : ouvre ./inbox/<nom>.part, retrouve l'offset déjà vérifié
+// s'il s'agit du même fichier, et prépare la réponse RESUME
+int open_received_file(FileTransfer *transfer) {
+    uint32_t magic, chunk;
+    uint64_t size, mtime;
+    memcpy(&magic, transfer->ctl, 4);
+    memcpy(&chunk, transfer->ctl + 4, 4);
+    memcpy(&size, transfer->ctl + 8, 8);
+    memcpy(&mtime, transfer->ctl + 16, 8);
+    if (be32toh(magic) != TRANSFER_MAGIC) {
+        printf("Error: %s uses an incompatible file transfer protocol\n", transfer->peer);
+        return -1;
+    }
+    transfer->chunk_size = be32toh(chunk);
+    transfer->size = be64toh(size);
+    transfer->mtime = be64toh(mtime);
+    if (transfer->chunk_size < 4096 || transfer->chunk_size > (64 << 20) || transfer->size < 0) {
+        printf("Error: Invalid file transfer header from %s\n", transfer->peer);
+        return -1;
+    }
+
+    if (mkdir("./inbox", 0755) == -1 && errno != EEXIST) {
+        perror("mkdir() inbox");
+    }
+    char record_path[PATH_MAX];
+    snprintf(transfer->path, sizeof(transfer->path), "./inbox/%s.part", transfer->filename);
+    resume_path(transfer, record_path, sizeof(record_path));
+    transfer->file_fd = open(transfer->path, O_RDWR | O_CREAT, 0644);
+    transfer->resume_fd = open(record_path, O_RDWR | O_CREAT, 0644);
+    if (transfer->file_fd < 0 || transfer->resume_fd < 0) {
+        perror("open() for received file");
+        return -1;
+    }
+
+    ResumeRecord record;
+    struct stat st;
+    off_t verified = 0;
+    if (pread(transfer->resume_fd, &record, sizeof(record), 0) == sizeof(record) &&
+        record.size == (uint64_t)transfer->size && record.mtime == transfer->mtime &&
+        record.verified <= record.size && fstat(transfer->file_fd, &st) == 0) {
+        verified = (off_t)record.verified < st.st_size ? (off_t)record.verified : st.st_size;
+    }
+
+    // Ce qui suit l'offset vérifié n'est pas fiable : réécrit depuis là
+    if (ftruncate(transfer->file_fd, verified) == -1 ||
+        lseek(transfer->file_fd, verified, SEEK_SET) == -1) {
+        perror("ftruncate() received file");
+        return -1;
+    }
+    if (transfer->size > verified) {
+        // Taille connue d'avance : l'espace est réservé d'un coup, l'échec est sans gravité
+        fallocate(transfer->file_fd, FALLOC_FL_KEEP_SIZE, verified, transfer->size - verified);
+    }
+    transfer->offset = transfer->chunk_start = transfer->resumed = verified;
+    save_resume(transfer);
+
+    if (pipe2(transfer->pipefd, O_NONBLOCK) == -1) {
+        transfer->copy = 1;
     } else {
-        printf("%s cancelled file transfer.\n", msg->infos);
+        fcntl(transfer->pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);  // Taille indicative, l'échec est sans gravité
+    }
+
+    if (verified > 0) {
+        printf("Resuming %s from byte %lld of %lld\n", transfer->filename,
+               (long long)verified, (long long)transfer->size);
+    } else {
+        printf("Receiving %s (%lld bytes)\n", transfer->filename, (long long)transfer->size);
+    }
+
+    uint64_t offset = htobe64(verified);
+    memcpy(transfer->ctl, &offset, 8);
+    transfer_ctl(transfer, 1, 8);
+    return 0;
+}
+
+// HELLO puis RESUME ; retourne 1 quand les deux sont passés, 0 s'il faut
+// attendre la socket, -1 en cas d'erreur
+int handshake_step(FileTransfer *transfer) {
+    while (1) {
+        int ret = transfer_ctl_step(transfer);
+        if (ret <= 0) return ret;
+
+        // Jeton remis au relais : l'échange continue comme en direct
+        if (transfer->relay_token[0] != '\0') {
+            transfer->relay_token[0] = '\0';
+            if (transfer->outgoing) {
+                send_hello(transfer);
+            } else {
+                transfer_ctl(transfer, 0, TRANSFER_HELLO_LEN);
+            }
+            continue;
+        }
+
+        if (transfer->ctl_len == TRANSFER_HELLO_LEN) {
+            if (transfer->outgoing) {
+                transfer_ctl(transfer, 0, 8);
+            } else if (open_received_file(transfer) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (transfer->outgoing) {
+            uint64_t offset;
+            memcpy(&offset, transfer->ctl, 8);
+            offset = be64toh(offset);
+            if (offset > (uint64_t)transfer->size) {
+                printf("Error: %s asked to resume beyond the end of %s\n", transfer->peer, transfer->path);
+                return -1;
+            }
+            if (offset > 0) {
+                printf("%s already has %lld bytes of %s, resuming\n", transfer->peer,
+                       (long long)offset, transfer->filename);
+            }
+            transfer->offset = transfer->resumed = offset;
+        }
+        transfer->ctl_len = 0;
+        return 1;
+    }
+}
+
+// Compare le bloc écrit à la somme reçue ; un bloc valide avance le point de reprise
+int verify_chunk(FileTransfer *transfer) {
+    uint32_t expected, crc;
+    memcpy(&expected, transfer->ctl, 4);
+    if (checksum_range(transfer, transfer->chunk_start, transfer->offset - transfer->chunk_start, &crc) == -1) {
+        return -1;
+    }
+    if (crc != be32toh(expected)) {
+        printf("Error: Checksum mismatch in %s at byte %lld\n", transfer->filename,
+               (long long)transfer->chunk_start);
+        return -1;
+    }
+    transfer->chunk_start = transfer->offset;
+    save_resume(transfer);
+    return 0;
+}
+
+// Socket -> tube -> fichier avec splice(), bloc par bloc ; retourne 1 quand
+// le dernier bloc est vérifié, 0 s'il faut attendre POLLIN, -1 en cas d'erreur
+int receive_file_step(FileTransfer *transfer) {
+    size_t budget = TRANSFER_STEP;
+    while (budget > 0) {
+        if (transfer->chunk_left == 0) {
+            // Bloc reçu en entier : sa somme suit
+            if (transfer->offset > transfer->chunk_start) {
+                if (transfer->ctl_len == 0) transfer_ctl(transfer, 0, 4);
+                int ret = transfer_ctl_step(transfer);
+                if (ret <= 0) return ret;
+                transfer->ctl_len = 0;
+                if (verify_chunk(transfer) == -1) return -1;
+            }
+            if (transfer->offset >= transfer->size) return 1;
+            transfer->chunk_left = next_chunk_len(transfer);
+        }
+
+        // Jamais au-delà du bloc : la somme qui suit ne doit pas finir dans le fichier
+        ssize_t n;
+        if (!transfer->copy) {
+            size_t len = transfer->chunk_left < SPLICE_CHUNK ? transfer->chunk_left : SPLICE_CHUNK;
+            n = splice(transfer->sock, NULL, transfer->pipefd[1], NULL, len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0 && transfer->offset == transfer->resumed && errno == EINVAL) {
+                transfer->copy = 1;
+                continue;
+            }
+        } else {
+            if (transfer_copy_buffer(transfer) == -1) return -1;
+            size_t len = transfer->chunk_left < COPY_BUF_SIZE ? transfer->chunk_left : COPY_BUF_SIZE;
+            n = recv(transfer->sock, transfer->buffer, len, 0);
+        }
+
+        if (n == 0) {
+            printf("Error: %s closed the connection before the end of %s\n",
+                   transfer->peer, transfer->filename);
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("recv() file data");
+            return -1;
+        }
+
+        // L'écriture sur disque reste bloquante : le tube est vidé aussitôt
+        ssize_t left = n;
+        while (left > 0) {
+            ssize_t written = transfer->copy
+                ? write(transfer->file_fd, transfer->buffer + (n - left), left)
+                : splice(transfer->pipefd[0], NULL, transfer->file_fd, NULL, left, SPLICE_F_MOVE);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                perror("write() file data");
+                return -1;
+            }
+            left -= written;
+        }
+        transfer->offset += n;
+        transfer->chunk_left -= n;
+        budget -= n < (ssize_t)budget ? n : (ssize_t)budget;
+    }
+    return 0;
+}
+
+// Dernier bloc vérifié : le fichier prend son nom définitif
+int finish_received_file(FileTransfer *transfer) {
+    char final_path[PATH_MAX];
+    char record_path[PATH_MAX];
+    snprintf(final_path, sizeof(final_path), "./inbox/%s", transfer->filename);
+    if (rename(transfer->path, final_path) == -1) {
+        perror("rename() received file");
+        return -1;
     }
+    resume_path(transfer, record_path, sizeof(record_path));
+    unlink(record_path);
+    close(transfer->resume_fd);
+    transfer->resume_fd = -1;
+    snprintf(transfer->path, sizeof(transfer->path), "%s", final_path);
+    return 0;
+}
+
+// Le pair s'est connecté : la socket d'écoute est remplacée par celle des
+// données, et son HELLO est attendu
+void start_receiving(FileTransfer *transfer) {
+    int data_fd = accept4(transfer->sock, NULL, NULL, SOCK_NONBLOCK);
+    if (data_fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        transfer_fail(transfer, "accept() file transfer");
+        return;
+    }
+    close(transfer->sock);
+    transfer->sock = data_fd;
+
+    transfer->state = XFER_HANDSHAKE;
+    transfer_ctl(transfer, 0, TRANSFER_HELLO_LEN);
 }
 
+void transfer_event(int sockfd, FileTransfer *transfer) {
+    switch (transfer->state) {
+        case XFER_LISTENING:
+            start_receiving(transfer);
+            break;
+
+        case XFER_CONNECTING: {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            if (getsockopt(transfer->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+                errno = err;
+                transfer_fail(transfer, "connect() for file transfer");
+                return;
+            }
+            transfer->state = XFER_HANDSHAKE;
+            if (transfer->relay_token[0] != '\0') {
+                snprintf((char *)transfer->ctl, sizeof(transfer->ctl), "%s\n", transfer->relay_token);
+                transfer_ctl(transfer, 1, RELAY_TOKEN_LEN + 1);
+            } else {
+                send_hello(transfer);
+            }
+        }
+        // fall through
+        case XFER_HANDSHAKE: {
+            int ret = handshake_step(transfer);
+            if (ret < 0) {
+                transfer_fail(transfer, NULL);
+            } else if (ret > 0) {
+                transfer->state = transfer->outgoing ? XFER_SENDING : XFER_RECEIVING;
+                clock_gettime(CLOCK_MONOTONIC, &transfer->start);
+            }
+            break;
+        }
+
+        case XFER_SENDING: {
+            int ret = send_file_step(transfer);
+            if (ret < 0) {
+                transfer_fail(transfer, NULL);
+            } else if (ret > 0) {
+                // Le récepteur confirme après avoir vérifié le dernier bloc
+                transfer->state = XFER_FINISHING;
+                transfer_ctl(transfer, 0, 1);
+            }
+            break;
+        }
+
+        case XFER_RECEIVING: {
+            int ret = receive_file_step(transfer);
+            if (ret == 0) break;
+            if (ret < 0 || finish_received_file(transfer) == -1) {
+                transfer_fail(transfer, NULL);
+                break;
+            }
+            report_throughput("received", transfer->offset - transfer->resumed,
+                              elapsed_since(&transfer->start));
+
+            struct message msg = {0};
+            msg.type = FILE_ACK;
+            strncpy(msg.infos, transfer->peer, INFOS_LEN - 1);
+            msg.pld_len = strlen(transfer->filename) + 1;
+            send_message(sockfd, &msg, transfer->filename);
+            printf("File saved in %s\n", transfer->path);
+
+            transfer->state = XFER_FINISHING;
+            transfer->ctl[0] = TRANSFER_DONE;
+            transfer_ctl(transfer, 1, 1);
+        }
+        // fall through
+        case XFER_FINISHING: {
+            int ret = transfer_ctl_step(transfer);
+            if (ret == 0) break;
+            if (transfer->outgoing) {
+                if (ret < 0 || transfer->ctl[0] != TRANSFER_DONE) {
+                    printf("Error: %s did not confirm the reception of %s\n", transfer->peer, transfer->filename);
+                    transfer_fail(transfer, NULL);
+                    break;
+                }
+                report_throughput("sent", transfer->offset - transfer->resumed,
+                                  elapsed_since(&transfer->start));
+            }
+            // Côté réception le fichier est déjà complet : la confirmation perdue est sans gravité
+            transfer_free(transfer);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_name> <server_port>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "rz")) != -1) {
+        switch (opt) {
+            case 'r':
+                prefer_relay = 1;
+                break;
+            case 'z':
+                want_compression = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r] [-z] <server_name> <server_port>\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: %s [-r] [-z] <server_name> <server_port>\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int sockfd = handle_connect(argv[1], argv[2]);
+    int sockfd = handle_connect(argv[optind], argv[optind + 1]);
     if (sockfd == -1) {
         fprintf(stderr, "Connection failed\n");
         exit(EXIT_FAILURE);
@@ -0,0 +1,72 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * CRC-32C (Castagnoli), somme de contrôle des blocs de fichier.
+ *
+ * Avec -msse4.2 le calcul utilise l'instruction crc32 du processeur ;
+ * sinon une table de 8 x 256 entrées traite 8 octets par tour. Les deux
+ * donnent le même résultat : un pair compilé sans SSE 4.2 reste compatible.
+ *
+ * Usage : crc = crc32c_update(0, data, len), puis de nouveau avec la suite.
+ */
+#define CRC32C_POLY 0x82F63B78u  // Polynôme réfléchi
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+
+static inline uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t c = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    uint32_t c32 = (uint32_t)c;
+    while (len--) c32 = _mm_crc32_u8(c32, *p++);
+    return ~c32;
+}
+
+#else
+
+static uint32_t crc32c_table[8][256];
+
+__attribute__((constructor))
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+        crc32c_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^
+                                 crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+static inline uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint32_t c = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        // Petit-boutiste : l'octet de poids faible est traité en premier
+        uint32_t lo = c ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                           (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        c = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+            crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+            crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    }
+    while (len--) c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xFF];
+    return ~c;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Journal asynchrone.
+ *
+ * Les appels log_*() formatent un enregistrement de taille fixe (heure,
+ * niveau, worker, texte) directement dans un anneau lock-free à plusieurs
+ * producteurs ; un thread de fond le vide vers stdout par paquets. Le
+ * thread appelant ne fait jamais d'entrée-sortie. Si l'anneau est plein,
+ * l'enregistrement est perdu et compté dans log_dropped.
+ *
+ * log_debug() disparaît entièrement à la compilation avec -DNDEBUG.
+ */
+#define LOG_RING_SIZE 4096  // Puissance de 2
+#define LOG_TEXT_LEN 160
+#define LOG_IDLE_US 5000
+
+typedef enum {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR
+} LogLevel;
+
+typedef struct {
+    _Atomic uint64_t seq;  // Position attendue : libre si seq == pos, prêt si seq == pos + 1
+    struct timespec time;
+    LogLevel level;
+    int worker;
+    char text[LOG_TEXT_LEN];
+} LogRecord;
+
+static LogRecord log_ring[LOG_RING_SIZE];
+static _Atomic uint64_t log_tail;  // Prochaine position à réserver (producteurs)
+static uint64_t log_head;          // Prochaine position à lire (thread de fond)
+static _Atomic uint64_t log_dropped;
+static LogLevel log_level = LOG_INFO;
+static __thread int log_worker = -1;  // Worker du thread appelant, -1 hors worker
+
+static const char *log_level_str[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+__attribute__((format(printf, 2, 3)))
+static inline void log_write(LogLevel level, const char *fmt, ...) {
+    if (level < log_level) return;
+
+    // Réserve une case (file bornée de Vyukov)
+    uint64_t pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    LogRecord *record;
+    while (1) {
+        record = &log_ring[pos & (LOG_RING_SIZE - 1)];
+        uint64_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    record->level = level;
+    record->worker = log_worker;
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record->text, LOG_TEXT_LEN, fmt, args);
+    va_end(args);
+    atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+}
+
+#ifdef NDEBUG
+#define log_debug(...) ((void)0)
+#else
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#endif
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+// Écrit les enregistrements prêts ; retourne leur nombre
+static inline int log_drain(FILE *out) {
+    int count = 0;
+    while (1) {
+        LogRecord *record = &log_ring[log_head & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&record->seq, memory_order_acquire) != log_head + 1) break;
+
+        struct tm tm;
+        char stamp[32];
+        localtime_r(&record->time.tv_sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        if (record->worker >= 0) {
+            fprintf(out, "%s.%06ld %-5s [w%d] %s\n", stamp, record->time.tv_nsec / 1000,
+                    log_level_str[record->level], record->worker, record->text);
+        } else {
+            fprintf(out, "%s.%06ld %-5s %s\n", stamp, record->time.tv_nsec / 1000,
+                    log_level_str[record->level], record->text);
+        }
+
+        // Rend la case aux producteurs pour le tour suivant de l'anneau
+        atomic_store_explicit(&record->seq, log_head + LOG_RING_SIZE, memory_order_release);
+        log_head++;
+        count++;
+    }
+    if (count > 0) fflush(out);
+    return count;
+}
+
+static inline void *log_thread(void *arg) {
+    FILE *out = arg;
+    uint64_t reported = 0;
+    while (1) {
+        int count = log_drain(out);
+
+        uint64_t dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+        if (dropped != reported) {
+            fprintf(out, "%llu log records dropped (ring full)\n",
+                    (unsigned long long)(dropped - reported));
+            fflush(out);
+            reported = dropped;
+        }
+        if (count == 0) usleep(LOG_IDLE_US);
+    }
+    return NULL;
+}
+
+static inline int log_start(FILE *out) {
+    for (uint64_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&log_ring[i].seq, i);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_thread, out) != 0) {
+        perror("pthread_create() logger");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Compteurs et histogrammes à un seul écrivain.
+ *
+ * Chaque compteur n'est modifié que par un thread (son worker) : une
+ * lecture suivie d'une écriture relâchées suffisent, sans instruction
+ * verrouillée dans le chemin critique. Les autres threads peuvent lire
+ * à tout moment une valeur cohérente, éventuellement un peu en retard.
+ *
+ * Histogramme log-linéaire (à la HDR) : 2^(HIST_SUB_BITS-1) cases par
+ * puissance de 2, soit une précision relative d'environ 3 %.
+ */
+#define HIST_SUB_BITS 6
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF + 2 * HIST_HALF)
+
+typedef _Atomic uint64_t Counter;
+
+typedef struct {
+    Counter counts[HIST_BUCKETS];
+    Counter total;
+    Counter sum;
+    Counter max;
+} Histogram;
+
+static inline uint64_t counter_get(Counter *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline void counter_add(Counter *counter, uint64_t n) {
+    atomic_store_explicit(counter, counter_get(counter) + n, memory_order_relaxed);
+}
+
+static inline int hist_index(uint64_t value) {
+    if (value < 2 * HIST_HALF) return (int)value;
+    int shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (int)(value >> shift);
+}
+
+// Plus grande valeur comptée dans la case index
+static inline uint64_t hist_value(int index) {
+    if (index < 2 * HIST_HALF) return index;
+    int shift = index / HIST_HALF - 1;
+    uint64_t mantissa = index - shift * HIST_HALF;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static inline void hist_record(Histogram *hist, uint64_t value) {
+    counter_add(&hist->counts[hist_index(value)], 1);
+    counter_add(&hist->total, 1);
+    counter_add(&hist->sum, value);
+    if (value > counter_get(&hist->max)) {
+        atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+    }
+}
+
+// Cumule src dans dst (dst appartient à l'appelant : instantané, agrégat)
+static inline void hist_merge(Histogram *dst, Histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        uint64_t count = counter_get(&src->counts[i]);
+        if (count) counter_add(&dst->counts[i], count);
+    }
+    counter_add(&dst->total, counter_get(&src->total));
+    counter_add(&dst->sum, counter_get(&src->sum));
+    if (counter_get(&src->max) > counter_get(&dst->max)) {
+        atomic_store_explicit(&dst->max, counter_get(&src->max), memory_order_relaxed);
+    }
+}
+
+static inline uint64_t hist_percentile(Histogram *hist, double percentile) {
+    uint64_t total = counter_get(&hist->total);
+    uint64_t max = counter_get(&hist->max);
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += counter_get(&hist->counts[i]);
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+#endif
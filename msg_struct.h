@@ -1,7 +1,14 @@
+#ifndef MSG_STRUCT_H
+#define MSG_STRUCT_H
+
 #define NICK_LEN 128
 #define INFOS_LEN 128
 #define FILE_PATH_LEN 256
 #define FILE_PORT 8081
+#define RELAY_TOKEN_LEN 16  // Jeton hexadécimal d'un transfert relayé par le serveur
+#define TRANSFER_MAGIC 0x43584631u  // "CXF1", en tête du HELLO d'un transfert (voir client.c)
+#define TRANSFER_HELLO_LEN 24
+#define TRANSFER_DONE 'K'
 
 enum msg_type { 
 	NICKNAME_NEW,
@@ -19,7 +26,11 @@ enum msg_type {
 	FILE_ACCEPT,
 	FILE_REJECT,
 	FILE_SEND,
-	FILE_ACK
+	FILE_ACK,
+	PROTO_HELLO,
+	STATS_QUERY,
+	SERVER_LINK,
+	SERVER_SYNC
 };
 
 struct message {
@@ -29,7 +40,7 @@ struct message {
 	char infos[INFOS_LEN];
 };
 
-static char* msg_type_str[] = {
+static char* msg_type_str[] __attribute__((unused)) = {
 	"NICKNAME_NEW",
 	"NICKNAME_LIST",
 	"NICKNAME_INFOS",
@@ -45,5 +56,11 @@ static char* msg_type_str[] = {
 	"FILE_ACCEPT",
 	"FILE_REJECT",
 	"FILE_SEND",
-	"FILE_ACK"
-};
\ No newline at end of file
+	"FILE_ACK",
+	"PROTO_HELLO",
+	"STATS_QUERY",
+	"SERVER_LINK",
+	"SERVER_SYNC"
+};
+
+#endif
\ No newline at end of file
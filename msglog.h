@@ -0,0 +1,293 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+
+/*
+ * Journal persistant des messages (unicast, broadcast, salons).
+ *
+ * Chaque worker écrit ses propres segments, <dir>/<worker>-<seq>.seg, en
+ * ajout seulement. Les enregistrements d'une itération de la boucle sont
+ * accumulés en mémoire puis écrits d'un seul write() suivi d'un seul
+ * fdatasync() (group commit). Le numéro de séquence est global : il
+ * ordonne les enregistrements de tous les workers.
+ *
+ * Enregistrement, dans l'ordre des octets de l'hôte :
+ *   MsgLogHeader, nick de l'émetteur, cible (pseudo ou salon), payload.
+ * La somme CRC-32C couvre tout ce qui suit le champ crc ; un enregistrement
+ * incomplet ou corrompu marque la fin du segment.
+ *
+ * La lecture passe par mmap() : elle ne fait aucun appel système par
+ * enregistrement et ne dérange pas les écrivains.
+ */
+#define MSGLOG_SEGMENT_SIZE (64 * 1024 * 1024)  // Taille au-delà de laquelle un segment est fermé
+#define MSGLOG_BATCH_MIN 4096
+
+typedef struct {
+    uint32_t crc;
+    uint32_t len;         // Longueur totale, en-tête compris
+    uint64_t seq;
+    int64_t time;         // Heure de réception (ns, CLOCK_REALTIME)
+    uint16_t type;        // enum msg_type
+    uint16_t sender_len;
+    uint16_t target_len;
+    uint16_t reserved;
+} MsgLogHeader;
+
+// Enregistrement lu : les pointeurs désignent la zone projetée
+typedef struct {
+    uint64_t seq;
+    int64_t time;
+    int type;
+    const char *sender;
+    size_t sender_len;
+    const char *target;
+    size_t target_len;
+    const char *payload;
+    size_t payload_len;
+} MsgLogEntry;
+
+// Segments d'un worker ; les enregistrements attendent le prochain commit dans batch
+typedef struct {
+    const char *dir;
+    int worker;
+    int fd;               // Segment courant, -1 tant qu'aucun n'est ouvert
+    size_t size;          // Octets déjà écrits dans le segment courant
+    unsigned char *batch;
+    size_t batch_len;
+    size_t batch_cap;
+    uint64_t batch_seq;   // Séquence du premier enregistrement du lot
+    int batch_records;
+} MsgLogWriter;
+
+typedef struct {
+    int segments;
+    uint64_t records;
+    uint64_t truncated;   // Octets de fin incomplète retirés
+    uint64_t next_seq;
+} MsgLogRecovery;
+
+static inline void msglog_writer_init(MsgLogWriter *writer, const char *dir, int worker) {
+    memset(writer, 0, sizeof(*writer));
+    writer->dir = dir;
+    writer->worker = worker;
+    writer->fd = -1;
+}
+
+static inline int msglog_append(MsgLogWriter *writer, uint64_t seq, int type, const char *sender,
+                                const char *target, const void *payload, size_t payload_len) {
+    size_t sender_len = strlen(sender);
+    size_t target_len = strlen(target);
+    size_t len = sizeof(MsgLogHeader) + sender_len + target_len + payload_len;
+    if (sender_len > UINT16_MAX || target_len > UINT16_MAX || len > UINT32_MAX) return -1;
+
+    if (writer->batch_len + len > writer->batch_cap) {
+        size_t cap = writer->batch_cap ? writer->batch_cap : MSGLOG_BATCH_MIN;
+        while (cap < writer->batch_len + len) cap *= 2;
+        unsigned char *batch = realloc(writer->batch, cap);
+        if (!batch) {
+            perror("realloc() message log batch");
+            return -1;
+        }
+        writer->batch = batch;
+        writer->batch_cap = cap;
+    }
+    if (writer->batch_records == 0) writer->batch_seq = seq;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    MsgLogHeader header = {
+        .len = (uint32_t)len,
+        .seq = seq,
+        .time = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec,
+        .type = (uint16_t)type,
+        .sender_len = (uint16_t)sender_len,
+        .target_len = (uint16_t)target_len,
+    };
+    unsigned char *record = writer->batch + writer->batch_len;
+    unsigned char *p = record + sizeof(header);
+    memcpy(p, sender, sender_len);
+    p += sender_len;
+    memcpy(p, target, target_len);
+    p += target_len;
+    if (payload_len > 0) memcpy(p, payload, payload_len);
+
+    header.crc = crc32c_update(0, (unsigned char *)&header + sizeof(header.crc),
+                               sizeof(header) - sizeof(header.crc));
+    header.crc = crc32c_update(header.crc, record + sizeof(header), len - sizeof(header));
+    memcpy(record, &header, sizeof(header));
+
+    writer->batch_len += len;
+    writer->batch_records++;
+    return 0;
+}
+
+static inline int msglog_open_segment(MsgLogWriter *writer) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%02d-%016llx.seg", writer->dir, writer->worker,
+             (unsigned long long)writer->batch_seq);
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (writer->fd == -1) {
+        perror("open() message log segment");
+        return -1;
+    }
+    writer->size = 0;
+    return 0;
+}
+
+// Lot non écrit : le segment est ramené à sa taille d'avant, sinon les lots
+// suivants seraient écrits derrière un enregistrement tronqué, illisibles.
+// Faute d'y parvenir, le prochain lot ouvre un nouveau segment.
+static inline void msglog_rollback(MsgLogWriter *writer) {
+    if (ftruncate(writer->fd, writer->size) == 0) return;
+    perror("ftruncate() message log");
+    close(writer->fd);
+    writer->fd = -1;
+}
+
+// Écrit le lot puis le rend durable ; retourne le nombre d'enregistrements
+// ou -1 (le lot est alors perdu)
+static inline int msglog_commit(MsgLogWriter *writer) {
+    if (writer->batch_records == 0) return 0;
+
+    int records = writer->batch_records;
+    writer->batch_records = 0;
+    size_t len = writer->batch_len;
+    writer->batch_len = 0;
+
+    if (writer->fd != -1 && writer->size >= MSGLOG_SEGMENT_SIZE) {
+        close(writer->fd);
+        writer->fd = -1;
+    }
+    if (writer->fd == -1 && msglog_open_segment(writer) == -1) return -1;
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(writer->fd, writer->batch + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write() message log");
+            msglog_rollback(writer);
+            return -1;
+        }
+        done += n;
+    }
+    if (fdatasync(writer->fd) == -1) {
+        perror("fdatasync() message log");
+        msglog_rollback(writer);
+        return -1;
+    }
+    writer->size += len;
+    return records;
+}
+
+// Enregistrement suivant à partir de *off ; 0 à la fin ou sur un
+// enregistrement incomplet ou corrompu (*off reste alors sur celui-ci)
+static inline int msglog_next(const unsigned char *base, size_t size, size_t *off, MsgLogEntry *entry) {
+    MsgLogHeader header;
+    if (size - *off < sizeof(header)) return 0;
+    memcpy(&header, base + *off, sizeof(header));
+    if (header.len < sizeof(header) || header.len > size - *off ||
+        (size_t)header.sender_len + header.target_len > header.len - sizeof(header)) {
+        return 0;
+    }
+
+    const unsigned char *body = base + *off + sizeof(header);
+    uint32_t crc = crc32c_update(0, (unsigned char *)&header + sizeof(header.crc),
+                                 sizeof(header) - sizeof(header.crc));
+    crc = crc32c_update(crc, body, header.len - sizeof(header));
+    if (crc != header.crc) return 0;
+
+    entry->seq = header.seq;
+    entry->time = header.time;
+    entry->type = header.type;
+    entry->sender = (const char *)body;
+    entry->sender_len = header.sender_len;
+    entry->target = entry->sender + header.sender_len;
+    entry->target_len = header.target_len;
+    entry->payload = entry->target + header.target_len;
+    entry->payload_len = header.len - sizeof(header) - header.sender_len - header.target_len;
+    *off += header.len;
+    return 1;
+}
+
+// Projette un segment en lecture ; *size vaut 0 pour un segment vide
+static inline const unsigned char *msglog_map(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("fstat() message log segment");
+        return NULL;
+    }
+    *size = st.st_size;
+    if (*size == 0) return NULL;
+    void *base = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap() message log segment");
+        return NULL;
+    }
+    madvise(base, *size, MADV_SEQUENTIAL);
+    return base;
+}
+
+static inline int msglog_is_segment(const char *name) {
+    size_t len = strlen(name);
+    return len > 4 && strcmp(name + len - 4, ".seg") == 0;
+}
+
+// Au démarrage : vérifie tous les segments, coupe les fins d'écriture
+// interrompues et retrouve la prochaine séquence
+static inline int msglog_recover(const char *dir, MsgLogRecovery *recovery) {
+    memset(recovery, 0, sizeof(*recovery));
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        perror("mkdir() message log");
+        return -1;
+    }
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror("opendir() message log");
+        return -1;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (!msglog_is_segment(ent->d_name)) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            perror("open() message log segment");
+            continue;
+        }
+
+        size_t size = 0, off = 0;
+        const unsigned char *base = msglog_map(fd, &size);
+        MsgLogEntry entry;
+        while (base && msglog_next(base, size, &off, &entry)) {
+            recovery->records++;
+            if (entry.seq >= recovery->next_seq) recovery->next_seq = entry.seq + 1;
+        }
+        if (base) munmap((void *)base, size);
+        if (off < size) {
+            recovery->truncated += size - off;
+            if (ftruncate(fd, off) == -1) perror("ftruncate() message log segment");
+        }
+        recovery->segments++;
+        close(fd);
+    }
+    closedir(d);
+    return 0;
+}
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -8,60 +9,480 @@
 #include <poll.h>
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <limits.h>
+#include <endian.h>
+#include <netdb.h>
 #include "msg_struct.h"
 #include "common.h"
+#include "wire.h"
+#include "metrics.h"
+#include "log.h"
+#include "msglog.h"
+#ifdef WITH_IO_URING
+#include "uring.h"
+#endif
 
-#define MAX_CLIENTS 100
-#define MAX_CHANNELS 100
 #define CHANNEL_NAME_LEN 32
 #define POLL_TIMEOUT -1
+#define MAX_EVENTS 256
+#define MAX_WORKERS 64
+#define MAX_IOV 64
+#define NAME_INDEX_MIN 256
+#define CLIENT_SLAB_SIZE 256
+#define CHANNEL_USERS_MIN 4
+#define INDEX_TOMBSTONE ((void *)-1)
+#define MSG_TYPE_COUNT ((int)(sizeof(msg_type_str) / sizeof(msg_type_str[0])))
+#define STATS_REQUEST_LEN 4096
+#define METRICS_TIMEOUT 2  // Secondes accordées à un client de /metrics pour lire ou écrire
+#define RELAY_MAX_SESSIONS 256
+#define RELAY_TIMEOUT 30  // Secondes laissées aux deux pairs pour se connecter au relais
+#define RELAY_PIPE_SIZE (1 << 20)
+#define RELAY_EVENTS 64
+#define RELAY_FILE_TTL 600  // Secondes pendant lesquelles un fichier de salon reste proposé
+#define SPOOL_CHUNK_MIN 4096        // Bornes des blocs annoncés, celles de client.c
+#define SPOOL_CHUNK_MAX (64 << 20)
+#define SPOOL_FILE_MB_DEFAULT 1024   // Taille maximale d'un fichier de salon
+#define SPOOL_TOTAL_MB_DEFAULT 4096  // Place occupée par tous les fichiers de salon
+#define HISTORY_LEN 64               // Messages gardés par salon
+#define HISTORY_CHANNEL_BYTES (64 * 1024)
+#define HISTORY_MEMORY_DEFAULT (16 * 1024 * 1024)  // Plafond pour l'ensemble des salons
+#define MSGLOG_QUERY_MAX HISTORY_LEN  // Messages relus dans le journal pour un salon
+#define OUT_LIMIT_BYTES_DEFAULT (1024 * 1024)  // File de sortie d'un client
+#define OUT_LIMIT_FRAMES_DEFAULT 8192
+#define OUT_GRACE 5       // Secondes de dépassement tolérées avant déconnexion
+#define OUT_HARD_FACTOR 4 // Au-delà de limite * OUT_HARD_FACTOR, déconnexion immédiate
+#define OUT_FLUSH_BYTES (64 * 1024)  // Écriture sans attendre la fin de l'itération
+#define MAX_LINKS 16             // Autres serveurs de la fédération
+#define LINK_RETRY 2             // Secondes entre deux tentatives de liaison sortante
+#define LINK_OUT_FACTOR 16       // La file d'une liaison porte le trafic de nombreux utilisateurs
+#define LINK_VERSION 1           // Protocole de liaison (SERVER_LINK, SERVER_SYNC)
+#define LIST_PAGE_ENTRIES 256    // Noms par page de NICKNAME_LIST et MULTICAST_LIST
+#define LIST_FRAME_BYTES (MSG_LEN - 1)
+#define LIST_SNAPSHOT_MIN 4096
+#define URING_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192    // Les réceptions multishot produisent beaucoup de complétions
+#define URING_BUF_COUNT 1024     // Tampons de réception fournis, par worker
+#define URING_BUF_SIZE 4096      // Laisse la place d'une trame partielle dans WireBuffer
+#define URING_SEND_IOV 256       // Un seul envoi en vol par client : il doit être large
+
+#define READ_AGAIN 0
+#define READ_SHORT 1
+#define READ_FULL 2
+
+typedef enum {
+    BACKEND_POLL,
+    BACKEND_EPOLL,
+    BACKEND_URING   // Compilé avec -DWITH_IO_URING
+} LoopBackend;
+
+// Réponse à un client qui ne lit pas assez vite (file de sortie pleine)
+typedef enum {
+    OUT_POLICY_DROP,        // Les plus anciens messages de discussion sont jetés
+    OUT_POLICY_COALESCE,    // Les avis en attente sont réduits au dernier, puis comme DROP
+    OUT_POLICY_DISCONNECT   // Rien n'est jeté ; déconnexion après OUT_GRACE secondes
+} OutPolicy;
+
+// Trame encodée une seule fois et partagée (lecture seule) par toutes les
+// files de sortie qui la référencent ; libérée par le dernier écrivain
+typedef struct {
+    atomic_int refs;
+    int type;  // enum msg_type : décide de ce qui peut être jeté
+    size_t len;
+    unsigned char data[];
+} OutBuf;
+
+// Serveur à joindre (-L) ; le thread des liaisons le rappelle tant que
+// linked vaut 0
+typedef struct LinkPeer {
+    char host[256];
+    char port[16];
+    atomic_int linked;  // Connexion en cours ou établie
+} LinkPeer;
+
+// Trame destinée à un client d'un autre worker, ou socket d'une liaison
+// sortante à adopter (peer non NULL, buf NULL)
+typedef enum {
+    MAILBOX_FRAME,       // Trame à mettre en file
+    MAILBOX_REPLAY,      // Trame relue dans le journal, passe avant les trames retenues
+    MAILBOX_REPLAY_END   // Fin d'une relecture (sans trame)
+} MailboxKind;
+
+typedef struct MailboxItem {
+    struct MailboxItem *next;
+    MailboxKind kind;
+    int fd;
+    unsigned long client_id;
+    OutBuf *buf;
+    LinkPeer *peer;
+} MailboxItem;
+
+// Mesures d'un worker, écrites par lui seul ; STATS_QUERY et l'export
+// Prometheus additionnent celles de tous les workers
+typedef struct {
+    Counter msgs_in[MSG_TYPE_COUNT];
+    Counter msgs_out[MSG_TYPE_COUNT];
+    Counter bytes_in;
+    Counter bytes_out;
+    Histogram loop_time;    // Durée d'une itération de la boucle (ns), attente exclue
+    Histogram fanout;       // Destinataires par message envoyé
+    Histogram queue_depth;  // Octets restant dans la file d'un client après un ajout
+    Counter log_records;    // Messages écrits dans le journal persistant
+    Counter log_commits;    // fdatasync() du journal, un par itération au plus
+    Counter out_dropped;     // Messages jetés d'une file pleine
+    Counter out_coalesced;   // Avis fusionnés dans une file pleine
+    Counter out_disconnects; // Clients déconnectés pour file pleine
+    Counter socket_writes;   // Appels d'écriture sur les sockets des clients
+} Metrics;
+
+// Un worker possède sa socket d'écoute (SO_REUSEPORT), sa boucle
+// d'événements et les clients qu'il a acceptés. Les entrées-sorties se
+// font en parallèle, les handlers un à la fois sous state_lock.
+typedef struct Worker {
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    int epfd;
+    int wake_fd;
+    MailboxItem *_Atomic mailbox;  // Pile lock-free (multi-producteurs, un consommateur)
+    WireBuffer in;  // Tampon de lecture partagé par tous les clients du worker
+    MsgLogWriter msglog;  // Enregistrements de l'itération en cours
+    struct Client **by_fd;  // Ses clients, indexés par descripteur : lus et écrits par lui seul
+    int by_fd_size;
+    struct Client **dirty;  // Files remplies pendant l'itération en cours (NULL : client retiré)
+    int dirty_count;
+    int dirty_capacity;
+#ifdef WITH_IO_URING
+    Uring ring;
+    UringBufRing bufs;    // Tampons des réceptions multishot
+#endif
+    Metrics metrics;
+} Worker;
+
+// Référence à une trame en attente d'écriture
+typedef struct OutChunk {
+    struct OutChunk *next;
+    OutBuf *buf;
+    size_t off;  // Octets déjà écrits
+} OutChunk;
 
 typedef struct {
+    OutChunk *head;
+    OutChunk *tail;
+    size_t bytes;
+    int frames;
+    int pinned;  // Trames de tête en cours d'envoi (io_uring) : à ne pas retirer
+} OutQueue;
+
+typedef struct Channel Channel;
+
+// Message de salon gardé pour les nouveaux arrivants. Les trames encodées
+// pour la diffusion sont conservées telles quelles ; un format manquant
+// est encodé au premier arrivant qui en a besoin.
+typedef struct HistoryEntry {
+    struct HistoryEntry *prev;  // Liste globale, de la plus ancienne à la plus récente
+    struct HistoryEntry *next;
+    Channel *channel;
+    size_t bytes;  // Mémoire comptée dans history_memory
+    OutBuf *encoded[WIRE_VERSION + 1];
+    struct message msg;
+    char payload[];
+} HistoryEntry;
+
+typedef struct Client {
     int fd;
+    unsigned long id;
+    int slot;          // Position dans client_manager.clients
+    Worker *owner;
+    int wire_version;  // WIRE_LEGACY tant que PROTO_HELLO n'a pas été négocié
+    unsigned char *partial;  // Trame incomplète en attente, NULL le plus souvent
+    size_t partial_len;
+    OutQueue out;
+    int replaying;   // Relectures du journal en cours : les autres trames attendent dans held
+    OutQueue held;
+    int want_write;  // EPOLLOUT/POLLOUT armé tant que la file n'est pas vide
+    time_t over_since;  // Début du dépassement de la limite de sortie, 0 sinon
+    int dirty;       // Position + 1 dans la liste des écritures de fin d'itération, 0 sinon
+    atomic_int closing;  // Lu par les autres workers (fanout_send)
+    int close_after_flush;  // Fermée dès que sa file est vide
     char nickname[NICK_LEN];
     struct sockaddr_in addr;
     time_t connection_time;
     int has_nickname;
-    char current_channel[CHANNEL_NAME_LEN];  // Nom du canal actuel
+    Channel *channel;  // Salon actuel, NULL si aucun
+    int channel_slot;  // Position dans channel->users
+    int is_link;       // Autre serveur, après SERVER_LINK ; nickname porte alors son nom
+    LinkPeer *peer;    // Liaison sortante : serveur configuré par -L
+    struct Client *link;        // Utilisateur distant : liaison de son serveur, sans socket
+    struct Client *ghosts;      // Liaison : ses utilisateurs distants
+    struct Client *ghost_prev;
+    struct Client *ghost_next;
+    struct Client *next_free;  // Chaînage des cases libres du pool
 } Client;
 
+// Les clients sont alloués par blocs qui ne sont jamais déplacés ni
+// rendus : un Client garde la même adresse toute sa vie et sa case est
+// réutilisée après sa déconnexion
+typedef struct ClientSlab {
+    struct ClientSlab *next;
+    Client clients[CLIENT_SLAB_SIZE];
+} ClientSlab;
+
+typedef struct {
+    ClientSlab *slabs;
+    Client *free_list;
+} ClientPool;
+
+// Index de noms (pseudos, salons) : adressage ouvert, sondage linéaire.
+// key() donne le nom d'une entrée.
+typedef struct {
+    void **slots;     // NULL : libre, INDEX_TOMBSTONE : entrée supprimée
+    size_t capacity;  // Puissance de 2
+    size_t used;      // Entrées et tombstones
+    size_t live;      // Entrées seules
+    const char *(*key)(const void *item);
+} NameIndex;
+
+// Liste des pseudos ou des salons, déjà mise en forme et triée par nom :
+// une page est une suite de lignes contiguës de text, envoyée sans copie.
+// Reconstruite à la première requête qui suit un changement.
+typedef struct {
+    uint32_t line;      // Début de la ligne dans text
+    uint32_t line_len;
+    uint32_t name;      // Nom dans names, terminé par '\0'
+} ListEntry;
+
 typedef struct {
-    Client clients[MAX_CLIENTS];
+    int valid;
+    char *text;         // Lignes "- nom...\n"
+    size_t text_len;
+    size_t text_cap;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    ListEntry *entries;
+    size_t capacity;
     int count;
-} ClientManager;
+} ListSnapshot;
 
 typedef struct {
+    Client **clients;  // Clients connectés, dans une table dense
+    int count;
+    int capacity;
+    ClientPool pool;
+    NameIndex nicks;
+    ListSnapshot list;  // Invalidée à chaque pseudo enregistré ou libéré
+} ClientManager;
+
+// Chaque salon est alloué à part : son adresse ne change pas tant qu'il existe
+struct Channel {
     char name[CHANNEL_NAME_LEN];
-    Client *users[MAX_CLIENTS];
+    Client **users;  // Agrandi à la demande
     int user_count;
-} Channel;
+    int user_capacity;
+    HistoryEntry **history;  // Anneau des HISTORY_LEN derniers messages, alloué au premier
+    int history_start;       // Plus ancien message
+    int history_count;
+    size_t history_bytes;
+    Channel *prev;  // Liste des salons, dans l'ordre de création
+    Channel *next;
+};
 
 typedef struct {
-    Channel channels[MAX_CHANNELS];
+    Channel *head;
+    Channel *tail;
     int count;
+    NameIndex names;
+    ListSnapshot list;  // Invalidée à chaque création, destruction, arrivée ou départ
 } ChannelManager;
 
-ClientManager client_manager = {0};
-ChannelManager channel_manager = {0};
+typedef enum {
+    RELAY_PAIR,      // Octets passés tels quels entre deux clients
+    RELAY_UPLOAD,    // Dépôt d'un fichier de salon
+    RELAY_DOWNLOAD   // Lecture d'un fichier de salon par un membre
+} RelayRole;
+
+// Étapes d'un transfert de fichier de salon, côté serveur (voir client.c) :
+// en dépôt HELLO est lu et RESUME envoyé, en lecture c'est l'inverse
+typedef enum {
+    SPOOL_HELLO,
+    SPOOL_RESUME,
+    SPOOL_DATA,
+    SPOOL_DONE
+} SpoolPhase;
+
+typedef enum {
+    SPOOL_UPLOADING,
+    SPOOL_READY,
+    SPOOL_FAILED
+} SpoolState;
+
+// Fichier envoyé à tout un salon : l'émetteur le dépose une seule fois
+// dans un fichier temporaire anonyme, que chaque membre qui accepte lit
+// ensuite à son rythme. Le flux est gardé tel quel (blocs et sommes) :
+// chaque destinataire vérifie lui-même les données de l'émetteur.
+typedef struct ChannelFile {
+    char sender[NICK_LEN];
+    struct Worker *sender_owner;  // Pour prévenir l'émetteur depuis le thread du relais
+    int sender_fd;
+    unsigned long sender_id;
+    int sender_wire;
+    char filename[FILE_PATH_LEN];
+    int fd;
+    unsigned char hello[TRANSFER_HELLO_LEN];  // HELLO de l'émetteur, rejoué à chaque membre
+    int announced;        // HELLO reçu, place réservée dans spool_reserved
+    uint32_t chunk_size;
+    off_t size;           // Taille du fichier
+    off_t total;          // Longueur du flux déposé, sommes comprises (réservée une fois annoncée)
+    off_t uploaded;       // Octets déjà déposés
+    unsigned long *offered;  // Id des membres à qui le fichier a été proposé
+    int offered_count;
+    struct RelayConn *downloads;  // Lectures en cours
+    // Sous relay_lock : les workers y cherchent les fichiers proposés
+    SpoolState state;
+    int refs;             // Sessions et connexions qui y font référence
+    time_t expires;       // Plus de nouvelle lecture après cette date
+    struct ChannelFile *next;
+} ChannelFile;
+
+// Relais de fichiers : une connexion de données, puis la moitié d'une
+// paire ou un dépôt ou une lecture de fichier de salon
+typedef struct RelayConn {
+    int fd;
+    RelayRole role;
+    struct RelayConn *peer;   // NULL tant que l'autre pair n'est pas arrivé
+    struct RelayConn *next;   // Liste des connexions non appariées
+    struct RelaySession *session;  // Session où la connexion attend son pair
+    ChannelFile *file;        // Fichier de salon déposé ou lu
+    struct RelayConn *next_download;
+    SpoolPhase phase;
+    unsigned char ctl[TRANSFER_HELLO_LEN];  // Message de contrôle en cours
+    int ctl_len;
+    int ctl_done;
+    int ctl_out;
+    off_t file_off;           // Lecture : position dans le flux déposé
+    char token[RELAY_TOKEN_LEN + 2];  // "<jeton>\n"
+    int token_len;            // Octets du jeton déjà lus
+    int pipefd[2];            // Octets reçus sur fd, en route vers peer
+    size_t pending;           // Octets dans le tube
+    size_t pipe_size;
+    int eof;                  // Fin de lecture sur fd
+    int shut;                 // Fin transmise à peer (shutdown)
+    int closed;               // Libérée à la fin du lot d'événements
+    time_t deadline;          // Appariement attendu avant cette date
+} RelayConn;
+
+// État du thread du relais
+typedef struct {
+    RelayConn *unpaired;  // Jeton pas encore lu ou pair pas encore arrivé
+    RelayConn *closed;    // À libérer après le lot d'événements courant
+} RelayLoop;
+
+// Transfert accepté en mode relais, en attente des deux connexions
+typedef struct RelaySession {
+    char token[RELAY_TOKEN_LEN + 1];  // Vide : case libre
+    time_t deadline;
+    RelayConn *waiting;  // Premier pair arrivé
+    ChannelFile *file;   // Fichier de salon : la session en détient une référence
+    int upload;
+} RelaySession;
+
+const char *client_key(const void *item);
+const char *channel_key(const void *item);
+
+ClientManager client_manager = { .nicks = { .key = client_key } };
+ChannelManager channel_manager = { .names = { .key = channel_key } };
+
+// Protège client_manager et channel_manager : la boucle le prend autour de
+// chaque appel à add_client, remove_client et handle_client_message. Les
+// lectures, les écritures et la boîte aux lettres n'en ont pas besoin : la
+// table des descripteurs, la trame partielle et la file de sortie d'un
+// client n'appartiennent qu'à son worker. L'état n'est pas partitionné :
+// ce verrou unique borne le débit des handlers, quel que soit le nombre
+// de workers.
+pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+unsigned long next_client_id = 1;
+
+// Historique de tous les salons (sous state_lock) : quand history_limit
+// est dépassé, les messages les plus anciens sont évincés, quel que soit
+// leur salon
+HistoryEntry *history_head;
+HistoryEntry *history_tail;
+size_t history_memory;
+size_t history_limit = HISTORY_MEMORY_DEFAULT;
+
+LoopBackend loop_backend = BACKEND_EPOLL;
+const char *metrics_port = NULL;  // Export Prometheus, désactivé par défaut
+const char *relay_port = NULL;    // Relais de fichiers, désactivé par défaut
+size_t out_limit_bytes = OUT_LIMIT_BYTES_DEFAULT;
+int out_limit_frames = OUT_LIMIT_FRAMES_DEFAULT;
+OutPolicy out_policy = OUT_POLICY_DROP;
+int cork_output = 0;  // MSG_MORE tant qu'une file ne tient pas en un seul appel
+Worker workers[MAX_WORKERS];
+int worker_count = 1;
+__thread Worker *current_worker;
+
+// Sessions créées par les workers (FILE_ACCEPT), appariées et libérées
+// par le thread du relais
+RelaySession relay_sessions[RELAY_MAX_SESSIONS];
+ChannelFile *channel_files;
+pthread_mutex_t relay_lock = PTHREAD_MUTEX_INITIALIZER;
+Counter relay_bytes;     // Écrits par le thread du relais seul
+off_t spool_file_max = (off_t)SPOOL_FILE_MB_DEFAULT << 20;
+off_t spool_total_max = (off_t)SPOOL_TOTAL_MB_DEFAULT << 20;
+off_t spool_reserved;    // Sous relay_lock : somme des flux annoncés encore gardés
+Counter relay_transfers;
+
+const char *msglog_dir = NULL;  // Journal persistant, désactivé par défaut
+uint64_t msglog_seq;            // Prochaine séquence (sous state_lock)
+
+// Fédération : liaisons établies (sous state_lock) et serveurs à joindre
+char node_name[NICK_LEN];
+const char *link_key = NULL;    // Sans clé (-K), aucune liaison n'est acceptée
+Client *links[MAX_LINKS];
+int link_count;
+int ghost_count;                // Utilisateurs distants
+LinkPeer link_peers[MAX_LINKS];
+int link_peer_count;
 
 
 void safe_strcpy(char *dest, const char *src, size_t size);
-void send_message(int fd, struct message *msg, const char *payload);
+void send_message(Client *client, struct message *msg, const char *payload);
+void flush_client(Client *client);
 Client *find_client_by_fd(int fd);
 Client *find_client_by_nickname(const char *nickname);
 void handle_nickname_new(Client *client, struct message *msg);
-void handle_nickname_list(Client *client);  // Ajout de cette déclaration
+void handle_nickname_list(Client *client, const char *request);
 void handle_nickname_infos(Client *client, struct message *msg);
 void handle_broadcast(Client *sender, struct message *msg, const char *payload);
 void handle_unicast(Client *sender, struct message *msg, const char *payload);
 void handle_channel_message(Client *client, const char *payload);
 void handle_channel_create(Client *client, const char *channel_name);
-void handle_channel_list(Client *client);
+void handle_channel_list(Client *client, const char *request);
 void handle_channel_join(Client *client, const char *channel_name);
 void handle_channel_quit(Client *client, const char *channel_name);
 void remove_from_current_channel(Client *client);
 void notify_channel(Channel *channel, const char *message, Client *exclude);
 Channel *find_channel_by_name(const char *name);
+void msglog_record(struct message *msg, const char *target, const char *payload);
+void msglog_query(Client *client, Channel *channel);
+void link_sync(Client *link, Client *user, const char *op, const char *channel);
+void link_drop(Client *client);
+void link_adopt(int fd, LinkPeer *peer);
+#ifdef WITH_IO_URING
+void uring_send(Client *client);
+void uring_arm_recv(Client *client);
+#endif
 
 // Utilitaires
 void safe_strcpy(char *dest, const char *src, size_t size) {
@@ -69,671 +490,4132 @@ void safe_strcpy(char *dest, const char *src, size_t size) {
     dest[size - 1] = '\0';
 }
 
-void send_message(int fd, struct message *msg, const char *payload) {
-    if (send(fd, msg, sizeof(struct message), 0) == -1) {
-        perror("send() message struct");
-        return;
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+Metrics *worker_metrics(void) {
+    return &current_worker->metrics;
+}
+
+OutBuf *outbuf_encode(int version, struct message *msg, const char *payload) {
+    size_t pld_len = (msg->pld_len > 0 && payload != NULL) ? msg->pld_len : 0;
+    OutBuf *buf = malloc(sizeof(OutBuf) + wire_frame_bound(version, pld_len));
+    if (!buf) {
+        perror("malloc() output buffer");
+        return NULL;
     }
-    
-    if (msg->pld_len > 0 && payload != NULL) {
-        if (send(fd, payload, msg->pld_len, 0) == -1) {
-            perror("send() payload");
-        }
+    atomic_init(&buf->refs, 1);
+    buf->type = msg->type;
+    buf->len = wire_encode(version, msg, payload, buf->data);
+    return buf;
+}
+
+OutBuf *outbuf_retain(OutBuf *buf) {
+    atomic_fetch_add(&buf->refs, 1);
+    return buf;
+}
+
+void outbuf_release(OutBuf *buf) {
+    if (atomic_fetch_sub(&buf->refs, 1) == 1) free(buf);
+}
+
+// Envoi d'un même message à plusieurs clients : la trame est encodée au
+// plus une fois par format, au premier destinataire qui l'utilise
+typedef struct {
+    struct message *msg;
+    const char *payload;
+    OutBuf *encoded[WIRE_VERSION + 1];
+    uint64_t recipients;
+    Client *links[MAX_LINKS];  // Liaisons déjà servies
+    int link_count;
+} Fanout;
+
+OutBuf *fanout_frame(Fanout *fanout, int version) {
+    if (!fanout->encoded[version]) {
+        fanout->encoded[version] = outbuf_encode(version, fanout->msg, fanout->payload);
     }
+    return fanout->encoded[version];
 }
 
-// Gestion des clients
-Client *find_client_by_fd(int fd) {
-    for (int i = 0; i < client_manager.count; i++) {
-        if (client_manager.clients[i].fd == fd) {
-            return &client_manager.clients[i];
-        }
+void fanout_release(Fanout *fanout) {
+    if (fanout->recipients > 0) hist_record(&worker_metrics()->fanout, fanout->recipients);
+    for (int i = 0; i <= WIRE_VERSION; i++) {
+        if (fanout->encoded[i]) outbuf_release(fanout->encoded[i]);
     }
-    return NULL;
 }
 
-Client *find_client_by_nickname(const char *nickname) {
-    for (int i = 0; i < client_manager.count; i++) {
-        if (client_manager.clients[i].has_nickname &&
-            strcmp(client_manager.clients[i].nickname, nickname) == 0) {
-            return &client_manager.clients[i];
+void mailbox_push(Worker *worker, MailboxItem *item) {
+    MailboxItem *head = atomic_load(&worker->mailbox);
+    do {
+        item->next = head;
+    } while (!atomic_compare_exchange_weak(&worker->mailbox, &head, item));
+
+    // Réveiller le worker seulement si sa boîte était vide
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(worker->wake_fd, &one, sizeof(one)) == -1) {
+            perror("write() eventfd");
         }
     }
-    return NULL;
 }
 
-// Validation des noms
-int is_nickname_valid(const char *nickname) {
-    size_t len = strlen(nickname);
-    if (len >= NICK_LEN || len == 0) return 0;
-    
-    for (size_t i = 0; i < len; i++) {
-        if (!isalnum(nickname[i])) return 0;
+// Les clients d'un autre worker sont servis par leur propre thread via sa
+// boîte aux lettres ; le worker vérifie (fd, id) avant d'écrire
+void mailbox_post_to(Worker *worker, int fd, unsigned long client_id, OutBuf *buf) {
+    MailboxItem *item = calloc(1, sizeof(MailboxItem));
+    if (!item) {
+        perror("malloc() mailbox item");
+        return;
     }
-    return 1;
+    item->fd = fd;
+    item->client_id = client_id;
+    item->buf = outbuf_retain(buf);
+    mailbox_push(worker, item);
 }
 
-int is_channel_name_valid(const char *name) {
-    size_t len = strlen(name);
-    if (len >= CHANNEL_NAME_LEN || len == 0) return 0;
-    
-    for (size_t i = 0; i < len; i++) {
-        if (!isalnum(name[i])) return 0;
+// Trame relue dans le journal : elle passe devant celles retenues pendant la relecture
+void mailbox_post_replay(Worker *worker, int fd, unsigned long client_id, OutBuf *buf) {
+    MailboxItem *item = calloc(1, sizeof(MailboxItem));
+    if (!item) {
+        perror("malloc() mailbox item");
+        return;
     }
-    return 1;
+    item->kind = MAILBOX_REPLAY;
+    item->fd = fd;
+    item->client_id = client_id;
+    item->buf = outbuf_retain(buf);
+    mailbox_push(worker, item);
 }
 
-// Gestion des salons
-Channel *find_channel_by_name(const char *name) {
-    for (int i = 0; i < channel_manager.count; i++) {
-        if (strcmp(channel_manager.channels[i].name, name) == 0) {
-            return &channel_manager.channels[i];
-        }
+// Confie au worker la socket d'une liaison sortante
+void mailbox_post_link(Worker *worker, int fd, LinkPeer *peer) {
+    MailboxItem *item = calloc(1, sizeof(MailboxItem));
+    if (!item) {
+        perror("malloc() mailbox item");
+        close(fd);
+        atomic_store(&peer->linked, 0);
+        return;
     }
-    return NULL;
+    item->fd = fd;
+    item->peer = peer;
+    mailbox_push(worker, item);
 }
 
-void notify_channel(Channel *channel, const char *message, Client *exclude) {
-    struct message notify = {0};
-    notify.type = ECHO_SEND;
-    safe_strcpy(notify.nick_sender, "Server", NICK_LEN);
-    safe_strcpy(notify.infos, message, INFOS_LEN);
+void mailbox_post(Worker *worker, Client *target, OutBuf *buf) {
+    mailbox_post_to(worker, target->fd, target->id, buf);
+}
 
-    for (int i = 0; i < channel->user_count; i++) {
-        if (channel->users[i] != exclude) {
-            send_message(channel->users[i]->fd, &notify, NULL);
-        }
+// Sockets non bloquantes : chaque client a sa file de sortie, vidée par writev()
+void out_queue_clear(OutQueue *queue) {
+    OutChunk *chunk = queue->head;
+    while (chunk) {
+        OutChunk *next = chunk->next;
+        outbuf_release(chunk->buf);
+        free(chunk);
+        chunk = next;
     }
+    queue->head = queue->tail = NULL;
+    queue->bytes = 0;
+    queue->frames = 0;
+    queue->pinned = 0;
 }
 
-void remove_from_current_channel(Client *client) {
-    if (client->current_channel[0] == '\0') return;
-    
-    Channel *channel = find_channel_by_name(client->current_channel);
-    if (!channel) return;
+// Dépassement de la limite de sortie, multipliée par factor
+int out_queue_over(OutQueue *queue, size_t factor) {
+    return queue->bytes > out_limit_bytes * factor ||
+           queue->frames > out_limit_frames * (int)factor;
+}
 
-    printf("Removing user %s from channel %s (current users: %d)\n", 
-           client->nickname, channel->name, channel->user_count);
+void set_write_interest(Client *client, int enable);
 
-    char notify_msg[INFOS_LEN];
-    snprintf(notify_msg, INFOS_LEN, "INFO> %.20s has quit %.20s",
-             client->nickname, channel->name);
-    
-    for (int i = 0; i < channel->user_count; i++) {
-        if (channel->users[i] == client) {
-            notify_channel(channel, notify_msg, client);
-            
-            // Déplacer le dernier utilisateur à cette position
-            channel->user_count--;
-            if (i < channel->user_count) {
-                channel->users[i] = channel->users[channel->user_count];
-            }
-            channel->users[channel->user_count] = NULL;
-
-            printf("After removal: Channel %s now has %d users\n", 
-                   channel->name, channel->user_count);
-
-            // Si c'était le dernier utilisateur
-            if (channel->user_count == 0) {
-                struct message destroy = {0};
-                destroy.type = ECHO_SEND;
-                safe_strcpy(destroy.nick_sender, "Server", NICK_LEN);
-                snprintf(destroy.infos, INFOS_LEN, 
-                        "INFO> You were the last user in this channel, %s has been destroyed", 
-                        channel->name);
-                send_message(client->fd, &destroy, NULL);
-
-                // Supprimer le canal
-                int idx = channel - channel_manager.channels;
-                printf("Removing empty channel %s at index %d\n", channel->name, idx);
-                channel_manager.count--;
-                if (idx < channel_manager.count) {
-                    channel_manager.channels[idx] = channel_manager.channels[channel_manager.count];
-                }
-            }
-            
-            client->current_channel[0] = '\0';
+// Une erreur d'écriture ferme la connexion : la boucle verra la fin de
+// connexion en lecture et retirera le client
+void mark_closing(Client *client) {
+    if (client->closing) return;
+    client->closing = 1;
+    out_queue_clear(&client->out);
+    out_queue_clear(&client->held);
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+// Ferme la connexion une fois sa file envoyée. Avec io_uring, flush_client()
+// ne fait que préparer l'envoi : la fermeture attend sa complétion.
+void close_after_flush(Client *client) {
+    client->close_after_flush = 1;
+    flush_client(client);
+}
+
+// Retire de la tête de la file les written octets envoyés
+void out_queue_consume(OutQueue *queue, size_t written) {
+    queue->bytes -= written;
+    counter_add(&worker_metrics()->bytes_out, written);
+    while (written > 0) {
+        OutChunk *chunk = queue->head;
+        size_t left = chunk->buf->len - chunk->off;
+        if (written < left) {
+            chunk->off += written;
             break;
         }
+        written -= left;
+        queue->head = chunk->next;
+        queue->frames--;
+        outbuf_release(chunk->buf);
+        free(chunk);
     }
+    if (!queue->head) queue->tail = NULL;
 }
-// Handlers pour les différents types de messages
-void handle_channel_create(Client *client, const char *channel_name) {
-    struct message response = {0};
-    response.type = ECHO_SEND;
-    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
 
-    // Vérifications habituelles
-    if (!is_channel_name_valid(channel_name)) {
-        safe_strcpy(response.infos, "Invalid channel name format", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
+void flush_client(Client *client) {
+#ifdef WITH_IO_URING
+    if (loop_backend == BACKEND_URING) {
+        uring_send(client);
         return;
     }
+#endif
+    OutQueue *queue = &client->out;
+    while (queue->head) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        size_t wanted = 0;
+        OutChunk *chunk = queue->head;
+        for (; chunk && iovcnt < MAX_IOV; chunk = chunk->next) {
+            iov[iovcnt].iov_base = chunk->buf->data + chunk->off;
+            iov[iovcnt].iov_len = chunk->buf->len - chunk->off;
+            wanted += iov[iovcnt].iov_len;
+            iovcnt++;
+        }
 
-    if (find_channel_by_name(channel_name)) {
-        safe_strcpy(response.infos, "Channel already exists", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
-        return;
+        // Avec MSG_MORE, le noyau attend la suite pour remplir ses segments ;
+        // le dernier appel de la file part sans
+        struct msghdr hdr = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        int flags = (cork_output && chunk) ? MSG_MORE : 0;
+        ssize_t written = sendmsg(client->fd, &hdr, flags);
+        counter_add(&worker_metrics()->socket_writes, 1);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            log_warn("sendmsg() on connection %d: %s", client->fd, strerror(errno));
+            mark_closing(client);
+            return;
+        }
+
+        out_queue_consume(queue, written);
+        // Écriture partielle : le tampon de la socket est plein
+        if ((size_t)written < wanted) break;
     }
 
-    if (channel_manager.count >= MAX_CHANNELS) {
-        safe_strcpy(response.infos, "Maximum number of channels reached", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
-        return;
+    if (!out_queue_over(queue, 1)) client->over_since = 0;
+    set_write_interest(client, queue->head != NULL);
+    if (client->close_after_flush && !queue->head) mark_closing(client);
+}
+
+// Ajoute une référence à buf en fin de file, sans écrire
+int out_queue_push(OutQueue *queue, OutBuf *buf) {
+    OutChunk *chunk = malloc(sizeof(OutChunk));
+    if (!chunk) {
+        perror("malloc() output chunk");
+        return -1;
     }
+    chunk->next = NULL;
+    chunk->buf = outbuf_retain(buf);
+    chunk->off = 0;
 
-    // Créer le nouveau canal d'abord et l'initialiser
-    Channel *new_channel = &channel_manager.channels[channel_manager.count];
-    memset(new_channel, 0, sizeof(Channel));
-    safe_strcpy(new_channel->name, channel_name, CHANNEL_NAME_LEN);
-    channel_manager.count++;  // Incrémenter le compteur tout de suite
+    if (queue->tail) queue->tail->next = chunk;
+    else queue->head = chunk;
+    queue->tail = chunk;
+    queue->bytes += buf->len;
+    queue->frames++;
+    return 0;
+}
 
-    // Sauvegarder l'ancien nom de canal
-    char old_channel[CHANNEL_NAME_LEN];
-    strncpy(old_channel, client->current_channel, CHANNEL_NAME_LEN);
+// Retire chunk, qui suit prev (NULL : chunk est en tête)
+void out_queue_remove(OutQueue *queue, OutChunk *prev, OutChunk *chunk) {
+    if (prev) prev->next = chunk->next;
+    else queue->head = chunk->next;
+    if (queue->tail == chunk) queue->tail = prev;
+    queue->bytes -= chunk->buf->len - chunk->off;
+    queue->frames--;
+    outbuf_release(chunk->buf);
+    free(chunk);
+}
 
-    // Mettre à jour le client avec son nouveau canal AVANT de quitter l'ancien
-    safe_strcpy(client->current_channel, channel_name, CHANNEL_NAME_LEN);
-    
-    // Ajouter le client au nouveau canal
-    new_channel->users[0] = client;
-    new_channel->user_count = 1;
+int is_chat_frame(OutBuf *buf) {
+    return buf->type == UNICAST_SEND || buf->type == BROADCAST_SEND || buf->type == MULTICAST_SEND;
+}
 
-    // Notifier de la création
-    snprintf(response.infos, INFOS_LEN, "You have created channel %s", channel_name);
-    send_message(client->fd, &response, NULL);
-
-    // Maintenant seulement, traiter l'ancien canal si nécessaire
-    if (old_channel[0] != '\0') {
-        Channel *old = find_channel_by_name(old_channel);
-        if (old) {
-            // Notifier les autres utilisateurs du départ
-            char notify_msg[INFOS_LEN];
-            snprintf(notify_msg, INFOS_LEN, "INFO> %.20s has quit %.20s",
-                     client->nickname, old_channel);
-            notify_channel(old, notify_msg, client);
-
-            // Retirer le client de l'ancien canal
-            for (int i = 0; i < old->user_count; i++) {
-                if (old->users[i] == client) {
-                    old->user_count--;
-                    if (i < old->user_count) {
-                        old->users[i] = old->users[old->user_count];
-                    }
-                    old->users[old->user_count] = NULL;
-                    break;
-                }
-            }
+// Ne garde que le plus récent des avis en attente
+void out_queue_coalesce(Client *client) {
+    OutQueue *queue = &client->out;
+    OutChunk *last = NULL;
+    for (OutChunk *chunk = queue->head; chunk; chunk = chunk->next) {
+        if (chunk->buf->type == ECHO_SEND) last = chunk;
+    }
 
-            // Si c'était le dernier utilisateur, supprimer le canal
-            if (old->user_count == 0) {
-                struct message destroy = {0};
-                destroy.type = ECHO_SEND;
-                safe_strcpy(destroy.nick_sender, "Server", NICK_LEN);
-                snprintf(destroy.infos, INFOS_LEN, 
-                        "INFO> You were the last user in this channel, %s has been destroyed", 
-                        old_channel);
-                send_message(client->fd, &destroy, NULL);
-
-                int idx = old - channel_manager.channels;
-                if (idx < channel_manager.count - 1) {
-                    channel_manager.channels[idx] = channel_manager.channels[channel_manager.count - 1];
-                }
-                channel_manager.count--;
-            }
+    OutChunk *prev = NULL, *chunk = queue->head;
+    for (int i = 0; chunk; i++) {
+        OutChunk *next = chunk->next;
+        // Une trame entamée ou en cours d'envoi doit partir en entier
+        if (chunk->buf->type == ECHO_SEND && chunk != last && chunk->off == 0 && i >= queue->pinned) {
+            out_queue_remove(queue, prev, chunk);
+            counter_add(&worker_metrics()->out_coalesced, 1);
+        } else {
+            prev = chunk;
         }
+        chunk = next;
     }
-
-    // Notifier que l'utilisateur a rejoint le nouveau canal
-    snprintf(response.infos, INFOS_LEN, "You have joined %s", channel_name);
-    send_message(client->fd, &response, NULL);
 }
-void handle_channel_list(Client *client) {
-    struct message response = {0};
-    response.type = ECHO_SEND;
-    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
 
-    char list[INFOS_LEN] = "Available channels:\n";
-    size_t remaining = INFOS_LEN - strlen(list);
-
-    for (int i = 0; i < channel_manager.count; i++) {
-        Channel *channel = &channel_manager.channels[i];
-        
-        printf("Channel: %s, Users: %d\n", channel->name, channel->user_count);
+// Jette les plus anciens messages de discussion jusqu'à repasser sous la limite
+void out_queue_drop_oldest(Client *client) {
+    OutQueue *queue = &client->out;
+    OutChunk *prev = NULL, *chunk = queue->head;
+    for (int i = 0; chunk && out_queue_over(queue, 1); i++) {
+        OutChunk *next = chunk->next;
+        if (is_chat_frame(chunk->buf) && chunk->off == 0 && i >= queue->pinned) {
+            out_queue_remove(queue, prev, chunk);
+            counter_add(&worker_metrics()->out_dropped, 1);
+        } else {
+            prev = chunk;
+        }
+        chunk = next;
+    }
+}
 
-        // Vérifier et ajouter le canal à la liste
-        int len = snprintf(NULL, 0, "- %s (%d users)\n", 
-                         channel->name, channel->user_count);
-        if (len < remaining) {
-            snprintf(list + strlen(list), remaining,
-                    "- %s (%d users)\n",
-                    channel->name, channel->user_count);
-            remaining -= len;
+// Applique la politique de contre-pression après un ajout dans la file
+void out_queue_enforce(Client *client) {
+    OutQueue *queue = &client->out;
+    // Liaison : rien n'est jeté (l'état répliqué en dépend) ; une liaison
+    // trop lente est coupée, puis rétablie avec un état complet
+    if (client->is_link) {
+        if (out_queue_over(queue, OUT_HARD_FACTOR * LINK_OUT_FACTOR)) {
+            log_warn("Link to server %s is too slow (%zu bytes queued), disconnecting",
+                     client->nickname, queue->bytes);
+            counter_add(&worker_metrics()->out_disconnects, 1);
+            mark_closing(client);
         }
+        return;
+    }
+    if (!out_queue_over(queue, 1)) {
+        client->over_since = 0;
+        return;
+    }
+
+    switch (out_policy) {
+        case OUT_POLICY_COALESCE:
+            out_queue_coalesce(client);
+            if (!out_queue_over(queue, 1)) break;
+            // fall through
+        case OUT_POLICY_DROP:
+            out_queue_drop_oldest(client);
+            break;
+        case OUT_POLICY_DISCONNECT:
+            break;
     }
 
-    safe_strcpy(response.infos, list, INFOS_LEN);
-    send_message(client->fd, &response, NULL);
+    // Trames de contrôle seules, ou politique DISCONNECT : délai de grâce
+    time_t now = time(NULL);
+    if (!out_queue_over(queue, 1)) {
+        client->over_since = 0;
+    } else if (client->over_since == 0) {
+        client->over_since = now;
+    }
+    if (out_queue_over(queue, OUT_HARD_FACTOR) ||
+        (client->over_since != 0 && now - client->over_since >= OUT_GRACE)) {
+        log_warn("Client %s is too slow (%zu bytes, %d frames queued), disconnecting",
+                 client->has_nickname ? client->nickname : "(anonymous)", queue->bytes, queue->frames);
+        counter_add(&worker_metrics()->out_disconnects, 1);
+        mark_closing(client);
+    }
 }
 
-// Ajouter cette fonction avec les autres fonctions de gestion des pseudos
-void handle_nickname_list(Client *client) {
-    struct message response = {0};
-    response.type = NICKNAME_LIST;
-    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-    
-    char list[INFOS_LEN] = "Online users:\n";
-    size_t remaining = INFOS_LEN - strlen(list);
-    
-    for (int i = 0; i < client_manager.count && remaining > 0; i++) {
-        if (client_manager.clients[i].has_nickname) {
-            int len = snprintf(NULL, 0, "- %s\n", client_manager.clients[i].nickname);
-            if (len < remaining) {
-                snprintf(list + strlen(list), remaining, "- %s\n", 
-                        client_manager.clients[i].nickname);
-                remaining -= len;
-            }
+// La file sera écrite une seule fois, en fin d'itération, quel que soit
+// le nombre de trames ajoutées d'ici là
+void mark_dirty(Client *client) {
+    if (client->dirty) return;
+
+    Worker *worker = client->owner;
+    if (worker->dirty_count == worker->dirty_capacity) {
+        int capacity = worker->dirty_capacity ? worker->dirty_capacity * 2 : CLIENT_SLAB_SIZE;
+        Client **dirty = realloc(worker->dirty, capacity * sizeof(Client *));
+        if (!dirty) {
+            perror("realloc() dirty clients");
+            flush_client(client);
+            return;
         }
+        worker->dirty = dirty;
+        worker->dirty_capacity = capacity;
     }
-    
-    safe_strcpy(response.infos, list, INFOS_LEN);
-    send_message(client->fd, &response, NULL);
+    worker->dirty[worker->dirty_count++] = client;
+    client->dirty = worker->dirty_count;
 }
-void handle_channel_join(Client *client, const char *channel_name) {
-    struct message response = {0};
-    response.type = ECHO_SEND;
-    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
 
-    Channel *channel = find_channel_by_name(channel_name);
-    if (!channel) {
-        safe_strcpy(response.infos, "Channel does not exist", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
-        return;
+// Fin d'itération : un appel d'écriture par client, pour toutes ses trames.
+// Hors state_lock : la file d'un client n'est touchée que par son worker,
+// et remove_client() retire lui-même le client de la liste.
+void flush_dirty(Worker *worker) {
+    for (int i = 0; i < worker->dirty_count; i++) {
+        Client *client = worker->dirty[i];
+        if (!client) continue;
+        client->dirty = 0;
+        flush_client(client);
     }
+    worker->dirty_count = 0;
+}
 
-    if (channel->user_count >= MAX_CLIENTS) {
-        safe_strcpy(response.infos, "Channel is full", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
-        return;
-    }
+// Ajoute une référence à buf dans la file du client (worker propriétaire uniquement)
+void queue_buf_now(Client *client, OutBuf *buf) {
+    if (client->closing) return;
+    if (out_queue_push(&client->out, buf) == -1) return;
 
-    // Si le client est déjà dans un autre salon, le faire quitter
-    if (client->current_channel[0] != '\0') {
-        remove_from_current_channel(client);
+    // Socket pleine : c'est l'événement d'écriture qui videra la file. Une
+    // rafale lue en une seule itération n'attend pas sa fin pour partir.
+    if (!client->want_write) {
+        if (client->out.bytes >= OUT_FLUSH_BYTES) flush_client(client);
+        else mark_dirty(client);
     }
+    out_queue_enforce(client);
+    hist_record(&worker_metrics()->queue_depth, client->out.bytes);
+}
 
-    // Ajouter l'utilisateur au canal
-    safe_strcpy(client->current_channel, channel_name, CHANNEL_NAME_LEN);
-    channel->users[channel->user_count] = client;
-    channel->user_count++;
+// Pendant une relecture du journal, les trames plus récentes attendent
+// que l'historique soit en file : le client reçoit tout dans l'ordre
+void queue_buf(Client *client, OutBuf *buf) {
+    if (client->closing) return;
+    if (!client->replaying) {
+        queue_buf_now(client, buf);
+        return;
+    }
+    if (out_queue_push(&client->held, buf) == -1) return;
+    if (out_queue_over(&client->held, OUT_HARD_FACTOR)) {
+        log_warn("Client %s receives too much during log replay, disconnecting",
+                 client->has_nickname ? client->nickname : "(anonymous)");
+        counter_add(&worker_metrics()->out_disconnects, 1);
+        mark_closing(client);
+    }
+}
 
-    // Debug: afficher le nombre d'utilisateurs
-    printf("Channel %s now has %d users\n", channel->name, channel->user_count);
+// Dernière trame relue arrivée : les trames retenues partent à leur tour
+void replay_end(Client *client) {
+    if (--client->replaying > 0) return;
+    for (OutChunk *chunk = client->held.head; chunk; chunk = chunk->next) {
+        queue_buf_now(client, chunk->buf);
+    }
+    out_queue_clear(&client->held);
+}
 
-    snprintf(response.infos, INFOS_LEN, "INFO> You have joined %s", channel_name);
-    send_message(client->fd, &response, NULL);
+void fanout_send(Fanout *fanout, Client *client);
 
-    // Notifier les autres utilisateurs
-    char notify_msg[INFOS_LEN];
-    snprintf(notify_msg, INFOS_LEN, "INFO> %.20s has joined %.20s",
-             client->nickname, channel_name);
-    notify_channel(channel, notify_msg, client);
+// Un message de discussion part une seule fois vers chaque serveur, quel
+// que soit le nombre de ses utilisateurs parmi les destinataires ; le
+// serveur distant le remet lui-même à ses clients
+void fanout_route(Fanout *fanout, Client *link) {
+    int type = fanout->msg->type;
+    if (type != BROADCAST_SEND && type != MULTICAST_SEND) return;
+    for (int i = 0; i < fanout->link_count; i++) {
+        if (fanout->links[i] == link) return;
+    }
+    if (fanout->link_count == MAX_LINKS) return;
+    fanout->links[fanout->link_count++] = link;
+    fanout_send(fanout, link);
 }
 
-void handle_channel_quit(Client *client, const char *channel_name) {
-    if (strcmp(client->current_channel, channel_name) != 0) {
-        struct message response = {0};
-        response.type = ECHO_SEND;
-        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-        safe_strcpy(response.infos, "You are not in this channel", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
+void fanout_send(Fanout *fanout, Client *client) {
+    // Utilisateur distant : les avis du serveur ne le concernent pas, son
+    // propre serveur les produit à partir de SERVER_SYNC
+    if (client->link) {
+        fanout_route(fanout, client->link);
         return;
     }
-    remove_from_current_channel(client);
+    if (client->closing) return;
 
-    
-}
-void handle_channel_message(Client *client, const char *payload) {
-    if (client->current_channel[0] == '\0') {
-        struct message response = {0};
-        response.type = ECHO_SEND;
-        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-        safe_strcpy(response.infos, "You are not in any channel", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
+    OutBuf *buf = fanout_frame(fanout, client->wire_version);
+    if (!buf) return;
+
+    fanout->recipients++;
+    if ((int)fanout->msg->type >= 0 && (int)fanout->msg->type < MSG_TYPE_COUNT) {
+        counter_add(&worker_metrics()->msgs_out[fanout->msg->type], 1);
+    }
+
+    if (client->owner != current_worker) {
+        mailbox_post(client->owner, client, buf);
         return;
     }
+    queue_buf(client, buf);
+}
 
-    Channel *channel = find_channel_by_name(client->current_channel);
-    if (!channel) return;
+void send_message(Client *client, struct message *msg, const char *payload) {
+    Fanout fanout = { .msg = msg, .payload = payload };
+    fanout_send(&fanout, client);
+    fanout_release(&fanout);
+}
 
-    struct message msg = {0};
-    msg.type = MULTICAST_SEND;
-    safe_strcpy(msg.nick_sender, client->nickname, NICK_LEN);
-    msg.pld_len = strlen(payload);
-    safe_strcpy(msg.infos, channel->name, INFOS_LEN);
+// Gestion des clients
+// Clients du worker courant seulement : aucun verrou n'est nécessaire
+Client *find_client_by_fd(int fd) {
+    Worker *worker = current_worker;
+    if (fd < 0 || fd >= worker->by_fd_size) return NULL;
+    return worker->by_fd[fd];
+}
 
-    for (int i = 0; i < channel->user_count; i++) {
-        if (channel->users[i] != client) {
-            printf("Sending to user: %s\n", channel->users[i]->nickname);
-            send_message(channel->users[i]->fd, &msg, payload);
+int fd_table_set(int fd, Client *client) {
+    Worker *worker = current_worker;
+    if (fd >= worker->by_fd_size) {
+        int size = worker->by_fd_size ? worker->by_fd_size : 64;
+        while (size <= fd) size *= 2;
+        Client **table = realloc(worker->by_fd, size * sizeof(Client *));
+        if (!table) {
+            perror("realloc() fd table");
+            return -1;
         }
+        memset(table + worker->by_fd_size, 0, (size - worker->by_fd_size) * sizeof(Client *));
+        worker->by_fd = table;
+        worker->by_fd_size = size;
     }
+    worker->by_fd[fd] = client;
+    return 0;
 }
 
-void handle_nickname_new(Client *client, struct message *msg) {
-    struct message response = {0};
-    response.type = NICKNAME_NEW;
-    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-    
-    if (!is_nickname_valid(msg->infos)) {
-        safe_strcpy(response.infos, "Invalid nickname format", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
-        return;
+Client *client_alloc(void) {
+    ClientPool *pool = &client_manager.pool;
+    if (!pool->free_list) {
+        ClientSlab *slab = malloc(sizeof(ClientSlab));
+        if (!slab) {
+            perror("malloc() client slab");
+            return NULL;
+        }
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        for (int i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+            slab->clients[i].next_free = pool->free_list;
+            pool->free_list = &slab->clients[i];
+        }
     }
-    
-    if (find_client_by_nickname(msg->infos)) {
-        safe_strcpy(response.infos, "Nickname already taken", INFOS_LEN);
-        send_message(client->fd, &response, NULL);
-        return;
+
+    Client *client = pool->free_list;
+    pool->free_list = client->next_free;
+    memset(client, 0, sizeof(Client));
+    return client;
+}
+
+void client_free(Client *client) {
+    client->next_free = client_manager.pool.free_list;
+    client_manager.pool.free_list = client;
+}
+
+int client_list_add(Client *client) {
+    if (client_manager.count == client_manager.capacity) {
+        int capacity = client_manager.capacity ? client_manager.capacity * 2 : CLIENT_SLAB_SIZE;
+        Client **clients = realloc(client_manager.clients, capacity * sizeof(Client *));
+        if (!clients) {
+            perror("realloc() client list");
+            return -1;
+        }
+        client_manager.clients = clients;
+        client_manager.capacity = capacity;
     }
-    
-    safe_strcpy(client->nickname, msg->infos, NICK_LEN);
-    client->has_nickname = 1;
-    safe_strcpy(response.infos, client->nickname, INFOS_LEN);
-    printf("User %s registered\n", client->nickname);
-    send_message(client->fd, &response, NULL);
+    client->slot = client_manager.count;
+    client_manager.clients[client_manager.count++] = client;
+    return 0;
 }
-void handle_nickname_infos(Client *client, struct message *msg) {
+
+// Le dernier client prend la place de celui qui part
+void client_list_remove(Client *client) {
+    Client *last = client_manager.clients[--client_manager.count];
+    client_manager.clients[client->slot] = last;
+    last->slot = client->slot;
+}
+
+// FNV-1a
+unsigned long hash_name(const char *name) {
+    unsigned long hash = 14695981039346656037UL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+const char *client_key(const void *item) {
+    return ((const Client *)item)->nickname;
+}
+
+const char *channel_key(const void *item) {
+    return ((const Channel *)item)->name;
+}
+
+// Retourne l'emplacement de l'entrée nommée name, ou NULL si elle est absente
+void **name_index_lookup(NameIndex *index, const char *name) {
+    if (index->capacity == 0) return NULL;
+
+    size_t mask = index->capacity - 1;
+    for (size_t i = hash_name(name) & mask; index->slots[i]; i = (i + 1) & mask) {
+        if (index->slots[i] != INDEX_TOMBSTONE &&
+            strcmp(index->key(index->slots[i]), name) == 0) {
+            return &index->slots[i];
+        }
+    }
+    return NULL;
+}
+
+int name_index_resize(NameIndex *index, size_t capacity) {
+    void **slots = calloc(capacity, sizeof(void *));
+    if (!slots) {
+        perror("calloc() name index");
+        return -1;
+    }
+
+    // Les tombstones disparaissent au passage
+    size_t used = 0;
+    for (size_t i = 0; i < index->capacity; i++) {
+        void *item = index->slots[i];
+        if (!item || item == INDEX_TOMBSTONE) continue;
+        size_t j = hash_name(index->key(item)) & (capacity - 1);
+        while (slots[j]) j = (j + 1) & (capacity - 1);
+        slots[j] = item;
+        used++;
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+    index->used = used;
+    return 0;
+}
+
+int name_index_insert(NameIndex *index, void *item) {
+    // Taille tirée des seules entrées : les tombstones laissés par les
+    // changements de pseudo ne font pas grossir la table. Remplie au quart
+    // au plus après reconstruction, elle accepte au moins capacity / 4
+    // insertions avant la suivante.
+    if ((index->used + 1) * 2 > index->capacity) {
+        size_t capacity = NAME_INDEX_MIN;
+        while ((index->live + 1) * 4 > capacity) capacity *= 2;
+        if (name_index_resize(index, capacity) == -1) return -1;
+    }
+
+    size_t mask = index->capacity - 1;
+    size_t i = hash_name(index->key(item)) & mask;
+    while (index->slots[i] && index->slots[i] != INDEX_TOMBSTONE) i = (i + 1) & mask;
+    if (!index->slots[i]) index->used++;
+    index->slots[i] = item;
+    index->live++;
+    return 0;
+}
+
+void name_index_remove(NameIndex *index, void *item) {
+    void **slot = name_index_lookup(index, index->key(item));
+    if (slot && *slot == item) {
+        *slot = INDEX_TOMBSTONE;
+        index->live--;
+    }
+}
+
+Client *find_client_by_nickname(const char *nickname) {
+    void **slot = name_index_lookup(&client_manager.nicks, nickname);
+    return slot ? *slot : NULL;
+}
+
+// Validation des noms
+int is_nickname_valid(const char *nickname) {
+    size_t len = strlen(nickname);
+    if (len >= NICK_LEN || len == 0) return 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum(nickname[i])) return 0;
+    }
+    return 1;
+}
+
+int is_channel_name_valid(const char *name) {
+    size_t len = strlen(name);
+    if (len >= CHANNEL_NAME_LEN || len == 0) return 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum(name[i])) return 0;
+    }
+    return 1;
+}
+
+// Gestion des salons
+Channel *find_channel_by_name(const char *name) {
+    void **slot = name_index_lookup(&channel_manager.names, name);
+    return slot ? *slot : NULL;
+}
+
+Channel *channel_create(const char *name) {
+    Channel *channel = calloc(1, sizeof(Channel));
+    if (!channel) {
+        perror("calloc() channel");
+        return NULL;
+    }
+    safe_strcpy(channel->name, name, CHANNEL_NAME_LEN);
+
+    if (name_index_insert(&channel_manager.names, channel) == -1) {
+        free(channel);
+        return NULL;
+    }
+
+    channel->prev = channel_manager.tail;
+    if (channel_manager.tail) channel_manager.tail->next = channel;
+    else channel_manager.head = channel;
+    channel_manager.tail = channel;
+    channel_manager.count++;
+    channel_manager.list.valid = 0;
+    return channel;
+}
+
+void history_clear(Channel *channel);
+
+void channel_destroy(Channel *channel) {
+    log_info("Removing empty channel %s", channel->name);
+    name_index_remove(&channel_manager.names, channel);
+
+    if (channel->prev) channel->prev->next = channel->next;
+    else channel_manager.head = channel->next;
+    if (channel->next) channel->next->prev = channel->prev;
+    else channel_manager.tail = channel->prev;
+    channel_manager.count--;
+    channel_manager.list.valid = 0;
+    history_clear(channel);
+    free(channel->users);
+    free(channel);
+}
+
+int channel_add(Channel *channel, Client *client) {
+    if (channel->user_count == channel->user_capacity) {
+        int capacity = channel->user_capacity ? channel->user_capacity * 2 : CHANNEL_USERS_MIN;
+        Client **users = realloc(channel->users, capacity * sizeof(Client *));
+        if (!users) {
+            perror("realloc() channel users");
+            return -1;
+        }
+        channel->users = users;
+        channel->user_capacity = capacity;
+    }
+    client->channel = channel;
+    client->channel_slot = channel->user_count;
+    channel->users[channel->user_count++] = client;
+    channel_manager.list.valid = 0;
+    if (!client->link) link_sync(NULL, client, "join", channel->name);
+    return 0;
+}
+
+void notify_channel(Channel *channel, const char *message, Client *exclude) {
+    struct message notify = {0};
+    notify.type = ECHO_SEND;
+    safe_strcpy(notify.nick_sender, "Server", NICK_LEN);
+    safe_strcpy(notify.infos, message, INFOS_LEN);
+
+    Fanout fanout = { .msg = &notify };
+    for (int i = 0; i < channel->user_count; i++) {
+        if (channel->users[i] != exclude) {
+            fanout_send(&fanout, channel->users[i]);
+        }
+    }
+    fanout_release(&fanout);
+}
+
+// Historique des salons
+void history_free(HistoryEntry *entry) {
+    if (entry->prev) entry->prev->next = entry->next;
+    else history_head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else history_tail = entry->prev;
+
+    history_memory -= entry->bytes;
+    entry->channel->history_bytes -= entry->bytes;
+    for (int i = 0; i <= WIRE_VERSION; i++) {
+        if (entry->encoded[i]) outbuf_release(entry->encoded[i]);
+    }
+    free(entry);
+}
+
+void history_evict_oldest(Channel *channel) {
+    HistoryEntry *entry = channel->history[channel->history_start];
+    channel->history[channel->history_start] = NULL;
+    channel->history_start = (channel->history_start + 1) % HISTORY_LEN;
+    channel->history_count--;
+    history_free(entry);
+}
+
+// Le plus ancien message de la liste globale est aussi le plus ancien de son salon
+void history_enforce_limit(void) {
+    while (history_memory > history_limit && history_head) {
+        history_evict_oldest(history_head->channel);
+    }
+}
+
+void history_clear(Channel *channel) {
+    while (channel->history_count > 0) history_evict_oldest(channel);
+    free(channel->history);
+    channel->history = NULL;
+}
+
+// Garde le message qui vient d'être diffusé, avec les trames déjà encodées
+void history_append(Channel *channel, Fanout *fanout) {
+    size_t pld_len = fanout->msg->pld_len > 0 ? fanout->msg->pld_len : 0;
+    size_t bytes = sizeof(HistoryEntry) + pld_len;
+    for (int i = 0; i <= WIRE_VERSION; i++) {
+        if (fanout->encoded[i]) bytes += sizeof(OutBuf) + fanout->encoded[i]->len;
+    }
+    if (bytes > HISTORY_CHANNEL_BYTES || bytes > history_limit) return;
+
+    if (!channel->history) {
+        channel->history = calloc(HISTORY_LEN, sizeof(HistoryEntry *));
+        if (!channel->history) {
+            perror("calloc() channel history");
+            return;
+        }
+    }
+    HistoryEntry *entry = calloc(1, sizeof(HistoryEntry) + pld_len);
+    if (!entry) {
+        perror("calloc() history entry");
+        return;
+    }
+    entry->channel = channel;
+    entry->bytes = bytes;
+    entry->msg = *fanout->msg;
+    if (pld_len > 0) memcpy(entry->payload, fanout->payload, pld_len);
+    for (int i = 0; i <= WIRE_VERSION; i++) {
+        if (fanout->encoded[i]) entry->encoded[i] = outbuf_retain(fanout->encoded[i]);
+    }
+
+    while (channel->history_count == HISTORY_LEN ||
+           (channel->history_count > 0 && channel->history_bytes + bytes > HISTORY_CHANNEL_BYTES)) {
+        history_evict_oldest(channel);
+    }
+    channel->history[(channel->history_start + channel->history_count) % HISTORY_LEN] = entry;
+    channel->history_count++;
+    channel->history_bytes += bytes;
+
+    entry->prev = history_tail;
+    if (history_tail) history_tail->next = entry;
+    else history_head = entry;
+    history_tail = entry;
+    history_memory += bytes;
+    history_enforce_limit();
+}
+
+// Met tout l'historique du salon dans la file du client (son propre worker)
+// et l'écrit d'un seul writev()
+void history_replay(Client *client, Channel *channel) {
+    if (client->closing) return;
+    // Salon recréé ou serveur redémarré : l'historique est relu dans le journal
+    if (channel->history_count == 0) {
+        msglog_query(client, channel);
+        return;
+    }
+
+    int version = client->wire_version;
+    int queued = 0;
+    for (int i = 0; i < channel->history_count; i++) {
+        HistoryEntry *entry = channel->history[(channel->history_start + i) % HISTORY_LEN];
+        if (!entry->encoded[version]) {
+            entry->encoded[version] = outbuf_encode(version, &entry->msg, entry->payload);
+            if (!entry->encoded[version]) break;
+            size_t bytes = sizeof(OutBuf) + entry->encoded[version]->len;
+            entry->bytes += bytes;
+            channel->history_bytes += bytes;
+            history_memory += bytes;
+        }
+        if (out_queue_push(&client->out, entry->encoded[version]) == -1) break;
+        queued++;
+    }
+
+    counter_add(&worker_metrics()->msgs_out[MULTICAST_SEND], queued);
+    if (!client->want_write) mark_dirty(client);
+    out_queue_enforce(client);
+    hist_record(&worker_metrics()->queue_depth, client->out.bytes);
+    // Après l'envoi : les trames évincées restent tenues par la file du client
+    history_enforce_limit();
+}
+
+// Retire client de channel, prévient les autres membres et détruit le
+// salon s'il est vide. client->channel n'est pas modifié.
+void channel_leave(Channel *channel, Client *client) {
+    log_debug("Removing user %s from channel %s (current users: %d)",
+              client->nickname, channel->name, channel->user_count);
+
+    int i = client->channel_slot;
+    if (i >= channel->user_count || channel->users[i] != client) return;
+
+    char notify_msg[INFOS_LEN];
+    snprintf(notify_msg, INFOS_LEN, "INFO> %.20s has quit %.20s",
+             client->nickname, channel->name);
+    notify_channel(channel, notify_msg, client);
+    
+    // Déplacer le dernier utilisateur à cette position
+    channel->user_count--;
+    if (i < channel->user_count) {
+        channel->users[i] = channel->users[channel->user_count];
+        channel->users[i]->channel_slot = i;
+    }
+    channel->users[channel->user_count] = NULL;
+    channel_manager.list.valid = 0;
+    if (!client->link) link_sync(NULL, client, "quit", channel->name);
+
+    log_debug("After removal: Channel %s now has %d users",
+              channel->name, channel->user_count);
+
+    // Si c'était le dernier utilisateur
+    if (channel->user_count == 0) {
+        struct message destroy = {0};
+        destroy.type = ECHO_SEND;
+        safe_strcpy(destroy.nick_sender, "Server", NICK_LEN);
+        snprintf(destroy.infos, INFOS_LEN, 
+                "INFO> You were the last user in this channel, %s has been destroyed", 
+                channel->name);
+        send_message(client, &destroy, NULL);
+
+        channel_destroy(channel);
+    }
+}
+
+void remove_from_current_channel(Client *client) {
+    if (!client->channel) return;
+
+    channel_leave(client->channel, client);
+    client->channel = NULL;
+}
+// Handlers pour les différents types de messages
+void handle_channel_create(Client *client, const char *channel_name) {
     struct message response = {0};
-    response.type = NICKNAME_INFOS;
+    response.type = ECHO_SEND;
     safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-    
-    Client *target = find_client_by_nickname(msg->infos);
-    if (target == NULL) {
-        snprintf(response.infos, INFOS_LEN, "User %.50s not found", msg->infos);
+
+    // Vérifications habituelles
+    if (!is_channel_name_valid(channel_name)) {
+        safe_strcpy(response.infos, "Invalid channel name format", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    if (find_channel_by_name(channel_name)) {
+        safe_strcpy(response.infos, "Channel already exists", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    Channel *new_channel = channel_create(channel_name);
+    if (!new_channel) {
+        safe_strcpy(response.infos, "Cannot create channel", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    // Notifier de la création
+    snprintf(response.infos, INFOS_LEN, "You have created channel %s", channel_name);
+    send_message(client, &response, NULL);
+
+    // Quitter l'ancien canal, puis ajouter le client au nouveau
+    remove_from_current_channel(client);
+    if (channel_add(new_channel, client) == -1) {
+        channel_destroy(new_channel);
+        safe_strcpy(response.infos, "Cannot join channel", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    // Notifier que l'utilisateur a rejoint le nouveau canal
+    snprintf(response.infos, INFOS_LEN, "You have joined %s", channel_name);
+    send_message(client, &response, NULL);
+}
+// Listes paginées
+int list_reserve(void **buf, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return 0;
+    size_t capacity = *cap ? *cap : LIST_SNAPSHOT_MIN;
+    while (capacity < need) capacity *= 2;
+    void *grown = realloc(*buf, capacity * elem);
+    if (!grown) {
+        perror("realloc() list snapshot");
+        return -1;
+    }
+    *buf = grown;
+    *cap = capacity;
+    return 0;
+}
+
+int list_append(ListSnapshot *list, const char *name, const char *line, size_t line_len) {
+    size_t name_len = strlen(name) + 1;
+    if (list_reserve((void **)&list->text, &list->text_cap, list->text_len + line_len, 1) == -1 ||
+        list_reserve((void **)&list->names, &list->names_cap, list->names_len + name_len, 1) == -1 ||
+        list_reserve((void **)&list->entries, &list->capacity, list->count + 1, sizeof(ListEntry)) == -1) {
+        return -1;
+    }
+
+    ListEntry *entry = &list->entries[list->count++];
+    entry->line = list->text_len;
+    entry->line_len = line_len;
+    entry->name = list->names_len;
+    memcpy(list->text + list->text_len, line, line_len);
+    list->text_len += line_len;
+    memcpy(list->names + list->names_len, name, name_len);
+    list->names_len += name_len;
+    return 0;
+}
+
+int compare_clients(const void *a, const void *b) {
+    return strcmp((*(Client * const *)a)->nickname, (*(Client * const *)b)->nickname);
+}
+
+int compare_channels(const void *a, const void *b) {
+    return strcmp((*(Channel * const *)a)->name, (*(Channel * const *)b)->name);
+}
+
+ListSnapshot *nickname_list(void) {
+    ListSnapshot *list = &client_manager.list;
+    if (list->valid) return list;
+
+    Client **sorted = malloc((client_manager.count + ghost_count + 1) * sizeof(Client *));
+    if (!sorted) {
+        perror("malloc() nickname list");
+        return NULL;
+    }
+    int count = 0;
+    for (int i = 0; i < client_manager.count; i++) {
+        if (client_manager.clients[i]->has_nickname) sorted[count++] = client_manager.clients[i];
+    }
+    for (int i = 0; i < link_count; i++) {
+        for (Client *ghost = links[i]->ghosts; ghost; ghost = ghost->ghost_next) {
+            sorted[count++] = ghost;
+        }
+    }
+    qsort(sorted, count, sizeof(Client *), compare_clients);
+
+    list->text_len = list->names_len = 0;
+    list->count = 0;
+    char line[NICK_LEN + 4];
+    for (int i = 0; i < count; i++) {
+        int len = snprintf(line, sizeof(line), "- %s\n", sorted[i]->nickname);
+        if (list_append(list, sorted[i]->nickname, line, len) == -1) {
+            free(sorted);
+            return NULL;
+        }
+    }
+    free(sorted);
+    list->valid = 1;
+    return list;
+}
+
+ListSnapshot *channel_list(void) {
+    ListSnapshot *list = &channel_manager.list;
+    if (list->valid) return list;
+
+    Channel **sorted = malloc((channel_manager.count + 1) * sizeof(Channel *));
+    if (!sorted) {
+        perror("malloc() channel list");
+        return NULL;
+    }
+    int count = 0;
+    for (Channel *channel = channel_manager.head; channel; channel = channel->next) {
+        sorted[count++] = channel;
+    }
+    qsort(sorted, count, sizeof(Channel *), compare_channels);
+
+    list->text_len = list->names_len = 0;
+    list->count = 0;
+    char line[CHANNEL_NAME_LEN + 32];
+    for (int i = 0; i < count; i++) {
+        int len = snprintf(line, sizeof(line), "- %s (%d users)\n",
+                           sorted[i]->name, sorted[i]->user_count);
+        if (list_append(list, sorted[i]->name, line, len) == -1) {
+            free(sorted);
+            return NULL;
+        }
+    }
+    free(sorted);
+    list->valid = 1;
+    return list;
+}
+
+// Premier nom qui n'est pas avant key (strict : premier nom après key)
+int list_search(ListSnapshot *list, const char *key, int strict) {
+    int lo = 0, hi = list->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(list->names + list->entries[mid].name, key);
+        if (cmp < 0 || (strict && cmp == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int list_match(ListSnapshot *list, int i, const char *prefix, size_t prefix_len) {
+    return i < list->count && strncmp(list->names + list->entries[i].name, prefix, prefix_len) == 0;
+}
+
+// Requête : infos "prefix=<début> after=<dernier nom reçu>", tous deux facultatifs.
+// Réponse : une page d'au plus LIST_PAGE_ENTRIES noms, en trames dont le
+// payload est une suite de lignes ; infos vaut "more", sauf sur la dernière
+// trame de la page : "next=<curseur>" s'il reste des noms, "end" sinon.
+// Un client à l'ancien format n'affiche que infos : il reçoit une seule
+// trame, legacy_title suivi d'autant de lignes qu'il en tient.
+void list_send(Client *client, ListSnapshot *list, int type, const char *request,
+               int legacy_type, const char *legacy_title) {
+    struct message response = {0};
+    response.type = type;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    if (!list) {
+        response.type = ECHO_SEND;
+        safe_strcpy(response.infos, "Server is out of memory", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    char prefix[NICK_LEN] = "";
+    char after[NICK_LEN] = "";
+    char args[INFOS_LEN];
+    safe_strcpy(args, request, INFOS_LEN);
+    char *save = NULL;
+    for (char *tok = strtok_r(args, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strncmp(tok, "prefix=", 7) == 0) safe_strcpy(prefix, tok + 7, NICK_LEN);
+        else if (strncmp(tok, "after=", 6) == 0) safe_strcpy(after, tok + 6, NICK_LEN);
+    }
+    size_t prefix_len = strlen(prefix);
+
+    // Le curseur est un nom et non une position : une page ne saute ni ne
+    // répète personne quand la liste change entre deux requêtes
+    int i = list_search(list, prefix, 0);
+    if (after[0]) {
+        int next = list_search(list, after, 1);
+        if (next > i) i = next;
+    }
+
+    if (client->wire_version == WIRE_LEGACY) {
+        response.type = legacy_type;
+        size_t len = snprintf(response.infos, INFOS_LEN, "%s\n", legacy_title);
+        for (; list_match(list, i, prefix, prefix_len) &&
+               len + list->entries[i].line_len < INFOS_LEN; i++) {
+            memcpy(response.infos + len, list->text + list->entries[i].line, list->entries[i].line_len);
+            len += list->entries[i].line_len;
+        }
+        response.infos[len] = '\0';
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    int sent = 0;
+    size_t start = i < list->count ? list->entries[i].line : 0;
+    size_t len = 0;
+    for (; list_match(list, i, prefix, prefix_len) && sent < LIST_PAGE_ENTRIES; i++, sent++) {
+        if (len + list->entries[i].line_len > LIST_FRAME_BYTES) {
+            safe_strcpy(response.infos, "more", INFOS_LEN);
+            response.pld_len = len;
+            send_message(client, &response, list->text + start);
+            start += len;
+            len = 0;
+        }
+        len += list->entries[i].line_len;
+    }
+
+    if (sent > 0 && list_match(list, i, prefix, prefix_len)) {
+        snprintf(response.infos, INFOS_LEN, "next=%s", list->names + list->entries[i - 1].name);
     } else {
-        char time_str[32];
-        strftime(time_str, sizeof(time_str), "%Y/%m/%d@%H:%M",
-                localtime(&target->connection_time));
-        
-        char ip_str[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(target->addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-        
-        snprintf(response.infos, INFOS_LEN, "%.20s connected since %.20s with IP %.15s port %d",
-                target->nickname, time_str, ip_str, ntohs(target->addr.sin_port));
+        safe_strcpy(response.infos, "end", INFOS_LEN);
+    }
+    response.pld_len = len;
+    send_message(client, &response, len > 0 ? list->text + start : NULL);
+}
+
+void handle_channel_list(Client *client, const char *request) {
+    list_send(client, channel_list(), MULTICAST_LIST, request, ECHO_SEND, "Available channels:");
+}
+
+void handle_nickname_list(Client *client, const char *request) {
+    list_send(client, nickname_list(), NICKNAME_LIST, request, NICKNAME_LIST, "Online users:");
+}
+
+void handle_channel_join(Client *client, const char *channel_name) {
+    struct message response = {0};
+    response.type = ECHO_SEND;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+
+    Channel *channel = find_channel_by_name(channel_name);
+    if (!channel) {
+        safe_strcpy(response.infos, "Channel does not exist", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    if (client->channel == channel) {
+        safe_strcpy(response.infos, "You are already in this channel", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    // Si le client est déjà dans un autre salon, le faire quitter
+    remove_from_current_channel(client);
+
+    // Ajouter l'utilisateur au canal
+    if (channel_add(channel, client) == -1) {
+        safe_strcpy(response.infos, "Cannot join channel", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    log_debug("Channel %s now has %d users", channel->name, channel->user_count);
+
+    snprintf(response.infos, INFOS_LEN, "INFO> You have joined %s", channel_name);
+    send_message(client, &response, NULL);
+    history_replay(client, channel);
+
+    // Notifier les autres utilisateurs
+    char notify_msg[INFOS_LEN];
+    snprintf(notify_msg, INFOS_LEN, "INFO> %.20s has joined %.20s",
+             client->nickname, channel_name);
+    notify_channel(channel, notify_msg, client);
+}
+
+void handle_channel_quit(Client *client, const char *channel_name) {
+    if (!client->channel || strcmp(client->channel->name, channel_name) != 0) {
+        struct message response = {0};
+        response.type = ECHO_SEND;
+        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+        safe_strcpy(response.infos, "You are not in this channel", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+    remove_from_current_channel(client);
+
+    
+}
+void handle_channel_message(Client *client, const char *payload) {
+    Channel *channel = client->channel;
+    if (!channel) {
+        struct message response = {0};
+        response.type = ECHO_SEND;
+        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+        safe_strcpy(response.infos, "You are not in any channel", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    struct message msg = {0};
+    msg.type = MULTICAST_SEND;
+    safe_strcpy(msg.nick_sender, client->nickname, NICK_LEN);
+    msg.pld_len = strlen(payload);
+    safe_strcpy(msg.infos, channel->name, INFOS_LEN);
+
+    Fanout fanout = { .msg = &msg, .payload = payload };
+    for (int i = 0; i < channel->user_count; i++) {
+        if (channel->users[i] != client) {
+            log_debug("Sending to user: %s", channel->users[i]->nickname);
+            fanout_send(&fanout, channel->users[i]);
+        }
+    }
+    history_append(channel, &fanout);
+    msglog_record(&msg, channel->name, payload);
+    fanout_release(&fanout);
+}
+
+void handle_nickname_new(Client *client, struct message *msg) {
+    struct message response = {0};
+    response.type = NICKNAME_NEW;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    
+    if (!is_nickname_valid(msg->infos)) {
+        safe_strcpy(response.infos, "Invalid nickname format", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+    
+    if (find_client_by_nickname(msg->infos)) {
+        safe_strcpy(response.infos, "Nickname already taken", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+    
+    if (client->has_nickname) {
+        link_sync(NULL, client, "gone", NULL);
+        name_index_remove(&client_manager.nicks, client);
+    }
+    safe_strcpy(client->nickname, msg->infos, NICK_LEN);
+    client->has_nickname = 1;
+    client_manager.list.valid = 0;
+    if (name_index_insert(&client_manager.nicks, client) == -1) {
+        client->has_nickname = 0;
+        safe_strcpy(response.infos, "Server is out of memory", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+    link_sync(NULL, client, "nick", NULL);
+    if (client->channel) link_sync(NULL, client, "join", client->channel->name);
+    safe_strcpy(response.infos, client->nickname, INFOS_LEN);
+    log_info("User %s registered", client->nickname);
+    send_message(client, &response, NULL);
+}
+void handle_nickname_infos(Client *client, struct message *msg) {
+    struct message response = {0};
+    response.type = NICKNAME_INFOS;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    
+    Client *target = find_client_by_nickname(msg->infos);
+    if (target == NULL) {
+        snprintf(response.infos, INFOS_LEN, "User %.50s not found", msg->infos);
+    } else if (target->link) {
+        snprintf(response.infos, INFOS_LEN, "%.20s is connected to server %.20s",
+                 target->nickname, target->link->nickname);
+    } else {
+        char time_str[32];
+        strftime(time_str, sizeof(time_str), "%Y/%m/%d@%H:%M",
+                localtime(&target->connection_time));
+        
+        char ip_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(target->addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+        
+        snprintf(response.infos, INFOS_LEN, "%.20s connected since %.20s with IP %.15s port %d",
+                target->nickname, time_str, ip_str, ntohs(target->addr.sin_port));
+    }
+    
+    send_message(client, &response, NULL);
+}
+
+void handle_broadcast(Client *sender, struct message *msg, const char *payload) {
+    struct message broadcast = *msg;
+    safe_strcpy(broadcast.nick_sender, sender->nickname, NICK_LEN);
+    
+    Fanout fanout = { .msg = &broadcast, .payload = payload };
+    for (int i = 0; i < client_manager.count; i++) {
+        if (client_manager.clients[i]->fd != sender->fd && 
+            client_manager.clients[i]->has_nickname) {
+            fanout_send(&fanout, client_manager.clients[i]);
+        }
+    }
+    for (int i = 0; i < link_count; i++) fanout_route(&fanout, links[i]);
+    msglog_record(&broadcast, "", payload);
+    fanout_release(&fanout);
+}
+
+// Réserve une session de relais ; le jeton est tiré au hasard pour qu'un
+// tiers ne puisse pas s'intercaler dans le transfert. Pour un fichier de
+// salon, la session reprend la référence de l'appelant.
+int relay_register(char *token, ChannelFile *file, int upload) {
+    unsigned char random[RELAY_TOKEN_LEN / 2];
+    if (getrandom(random, sizeof(random), 0) != sizeof(random)) {
+        perror("getrandom()");
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(random); i++) {
+        sprintf(token + 2 * i, "%02x", random[i]);
+    }
+
+    pthread_mutex_lock(&relay_lock);
+    for (int i = 0; i < RELAY_MAX_SESSIONS; i++) {
+        RelaySession *session = &relay_sessions[i];
+        if (session->token[0] != '\0') continue;
+        safe_strcpy(session->token, token, sizeof(session->token));
+        session->deadline = time(NULL) + RELAY_TIMEOUT;
+        session->waiting = NULL;
+        session->file = file;
+        session->upload = upload;
+        pthread_mutex_unlock(&relay_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&relay_lock);
+    log_warn("Too many pending relayed transfers");
+    return -1;
+}
+
+// Le destinataire accepte en mode relais ("relay <fichier>") : les deux
+// pairs reçoivent FILE_ACCEPT avec "relay:<jeton> <fichier>" et se
+// connectent au port du relais
+void handle_relay_accept(Client *receiver, Client *sender, struct message *msg, const char *filename) {
+    struct message forward = *msg;
+    char token[RELAY_TOKEN_LEN + 1];
+    char payload[MSG_LEN];
+
+    if (!relay_port || relay_register(token, NULL, 0) == -1) {
+        // Les deux demandes en attente sont abandonnées
+        forward.type = FILE_REJECT;
+        forward.pld_len = strlen(filename) + 1;
+        safe_strcpy(forward.infos, receiver->nickname, NICK_LEN);
+        send_message(sender, &forward, filename);
+        safe_strcpy(forward.infos, sender->nickname, NICK_LEN);
+        safe_strcpy(forward.nick_sender, "Server", NICK_LEN);
+        send_message(receiver, &forward, filename);
+        return;
+    }
+
+    snprintf(payload, MSG_LEN, "relay:%s %s", token, filename);
+    forward.pld_len = strlen(payload) + 1;
+    safe_strcpy(forward.infos, receiver->nickname, NICK_LEN);
+    send_message(sender, &forward, payload);
+    safe_strcpy(forward.infos, sender->nickname, NICK_LEN);
+    safe_strcpy(forward.nick_sender, "Server", NICK_LEN);
+    send_message(receiver, &forward, payload);
+    log_debug("Relayed transfer %s: %s -> %s", token, sender->nickname, receiver->nickname);
+}
+
+// Fichier de dépôt anonyme : il disparaît de lui-même à sa fermeture
+int spool_open(void) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir) dir = "/tmp";
+    int fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd == -1 && errno == EOPNOTSUPP) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/chat-spool-XXXXXX", dir);
+        fd = mkstemp(path);
+        if (fd != -1) unlink(path);
+    }
+    if (fd == -1) perror("open() spool file");
+    return fd;
+}
+
+void refuse_channel_file(Client *sender, const char *filename, const char *reason) {
+    struct message response = {0};
+    response.type = ECHO_SEND;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    safe_strcpy(response.infos, reason, INFOS_LEN);
+    send_message(sender, &response, NULL);
+
+    response.type = FILE_REJECT;
+    safe_strcpy(response.infos, "#", INFOS_LEN);
+    response.pld_len = strlen(filename) + 1;
+    send_message(sender, &response, filename);
+}
+
+// FILE_REQUEST vers "#" : l'émetteur dépose le fichier une seule fois par
+// le relais, puis chaque membre du salon se le voit proposer
+void handle_channel_file_request(Client *sender, const char *filename) {
+    if (!sender->channel) {
+        refuse_channel_file(sender, filename, "You are not in a channel");
+        return;
+    }
+    if (!relay_port) {
+        refuse_channel_file(sender, filename, "File relay is not enabled on this server");
+        return;
+    }
+
+    ChannelFile *file = calloc(1, sizeof(ChannelFile));
+    if (!file || (file->fd = spool_open()) == -1) {
+        free(file);
+        refuse_channel_file(sender, filename, "Cannot store the file on the server");
+        return;
+    }
+    // Seuls les membres présents au moment de l'offre pourront le lire ;
+    // la liste n'est plus modifiée une fois le fichier publié
+    Channel *channel = sender->channel;
+    file->offered = malloc(channel->user_count * sizeof(unsigned long));
+    if (!file->offered) {
+        perror("malloc() channel file members");
+        close(file->fd);
+        free(file);
+        refuse_channel_file(sender, filename, "Cannot store the file on the server");
+        return;
+    }
+    for (int i = 0; i < channel->user_count; i++) {
+        Client *member = channel->users[i];
+        if (member != sender && !member->link) file->offered[file->offered_count++] = member->id;
+    }
+    safe_strcpy(file->sender, sender->nickname, NICK_LEN);
+    file->sender_owner = sender->owner;
+    file->sender_fd = sender->fd;
+    file->sender_id = sender->id;
+    file->sender_wire = sender->wire_version;
+    safe_strcpy(file->filename, filename, FILE_PATH_LEN);
+    file->state = SPOOL_UPLOADING;
+    file->refs = 1;
+    file->expires = time(NULL) + RELAY_FILE_TTL;
+
+    char token[RELAY_TOKEN_LEN + 1];
+    if (relay_register(token, file, 1) == -1) {
+        close(file->fd);
+        free(file->offered);
+        free(file);
+        refuse_channel_file(sender, filename, "Too many file transfers in progress");
+        return;
+    }
+    pthread_mutex_lock(&relay_lock);
+    file->next = channel_files;
+    channel_files = file;
+    pthread_mutex_unlock(&relay_lock);
+
+    char payload[MSG_LEN];
+    struct message response = {0};
+    response.type = FILE_ACCEPT;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    safe_strcpy(response.infos, "#", INFOS_LEN);
+    snprintf(payload, MSG_LEN, "relay:%s %s", token, filename);
+    response.pld_len = strlen(payload) + 1;
+    send_message(sender, &response, payload);
+
+    // Une seule trame encodée pour tout le salon
+    struct message offer = {0};
+    offer.type = FILE_REQUEST;
+    safe_strcpy(offer.nick_sender, sender->nickname, NICK_LEN);
+    snprintf(offer.infos, INFOS_LEN, "#%s", sender->channel->name);
+    offer.pld_len = strlen(filename) + 1;
+    Fanout fanout = { .msg = &offer, .payload = filename };
+    for (int i = 0; i < sender->channel->user_count; i++) {
+        if (sender->channel->users[i] != sender) {
+            fanout_send(&fanout, sender->channel->users[i]);
+        }
+    }
+    fanout_release(&fanout);
+    log_debug("Channel file %s from %s offered to %llu members", filename, sender->nickname,
+              (unsigned long long)fanout.recipients);
+}
+
+int channel_file_offered(ChannelFile *file, Client *client) {
+    for (int i = 0; i < file->offered_count; i++) {
+        if (file->offered[i] == client->id) return 1;
+    }
+    return 0;
+}
+
+// Réponse d'un membre à un fichier de salon ; retourne 0 si la réponse
+// concerne un transfert ordinaire
+int handle_channel_file_answer(Client *receiver, struct message *msg, const char *payload) {
+    if (msg->pld_len <= 0) return 0;
+    const char *filename = payload;
+    if (msg->type == FILE_ACCEPT) {
+        // Le serveur ne peut que servir le fichier par son relais
+        if (strncmp(payload, "relay ", 6) != 0) return 0;
+        filename += 6;
+    }
+
+    time_t now = time(NULL);
+    pthread_mutex_lock(&relay_lock);
+    ChannelFile *file = channel_files;
+    while (file && (strcmp(file->sender, msg->infos) != 0 || strcmp(file->filename, filename) != 0 ||
+                    file->state == SPOOL_FAILED || file->expires < now)) {
+        file = file->next;
+    }
+    int offered = file && channel_file_offered(file, receiver);
+    if (offered && msg->type == FILE_ACCEPT) file->refs++;
+    pthread_mutex_unlock(&relay_lock);
+
+    if (!file) return 0;
+    if (msg->type != FILE_ACCEPT) return 1;  // Refus : rien à faire
+
+    struct message response = *msg;
+    char token[RELAY_TOKEN_LEN + 1];
+    char answer[MSG_LEN];
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    // Membre absent lors de l'offre : le fichier ne lui est pas destiné
+    if (!offered) {
+        log_warn("Client %s asked for channel file %s without an offer", receiver->nickname, filename);
+        response.type = FILE_REJECT;
+        response.pld_len = strlen(filename) + 1;
+        send_message(receiver, &response, filename);
+        return 1;
+    }
+    if (relay_register(token, file, 0) == -1) {
+        pthread_mutex_lock(&relay_lock);
+        file->refs--;
+        pthread_mutex_unlock(&relay_lock);
+        response.type = FILE_REJECT;
+        response.pld_len = strlen(filename) + 1;
+        send_message(receiver, &response, filename);
+        return 1;
+    }
+    snprintf(answer, MSG_LEN, "relay:%s %s", token, filename);
+    response.pld_len = strlen(answer) + 1;
+    send_message(receiver, &response, answer);
+    return 1;
+}
+
+void handle_unicast(Client *sender, struct message *msg, const char *payload) {
+    if (msg->type == FILE_REQUEST && strcmp(msg->infos, "#") == 0 && msg->pld_len > 0) {
+        handle_channel_file_request(sender, payload);
+        return;
+    }
+    if ((msg->type == FILE_ACCEPT || msg->type == FILE_REJECT) &&
+        handle_channel_file_answer(sender, msg, payload)) {
+        return;
+    }
+
+    // Utilisateur d'un autre serveur : la trame part telle quelle, son
+    // serveur la traite comme si elle venait d'un de ses clients
+    Client *remote = find_client_by_nickname(msg->infos);
+    if (remote && remote->link) {
+        struct message routed = *msg;
+        safe_strcpy(routed.nick_sender, sender->nickname, NICK_LEN);
+        if (msg->type == FILE_ACCEPT && msg->pld_len > 0 && strncmp(payload, "relay ", 6) == 0) {
+            struct message response = {0};
+            response.type = ECHO_SEND;
+            safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+            snprintf(response.infos, INFOS_LEN, "%.20s is on server %.20s: relayed transfers stay on one server",
+                     remote->nickname, remote->link->nickname);
+            send_message(sender, &response, NULL);
+            return;
+        }
+        send_message(remote->link, &routed, payload);
+        return;
+    }
+
+    if (msg->type == FILE_REQUEST || msg->type == FILE_ACCEPT || 
+        msg->type == FILE_REJECT || msg->type == FILE_ACK) {
+        Client *target = find_client_by_nickname(msg->infos);
+        
+        if (msg->type == FILE_REQUEST && !target) {
+            struct message response = {0};
+            response.type = ECHO_SEND;
+            safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+            snprintf(response.infos, INFOS_LEN, "User %.100s does not exist", msg->infos);
+            send_message(sender, &response, NULL);
+            return;
+        }
+
+        if (target) {
+            if (msg->type == FILE_ACCEPT && msg->pld_len > 0 && strncmp(payload, "relay ", 6) == 0) {
+                handle_relay_accept(sender, target, msg, payload + 6);
+                return;
+            }
+
+            struct message forward = *msg;
+            if (msg->type == FILE_ACCEPT || msg->type == FILE_REJECT) {
+                safe_strcpy(forward.infos, sender->nickname, NICK_LEN);
+            } else {
+                safe_strcpy(forward.nick_sender, sender->nickname, NICK_LEN);
+            }
+            send_message(target, &forward, payload);
+            return;
+        }
+        return;
+    }
+
+    Client *target = find_client_by_nickname(msg->infos);
+    if (!target) {
+        struct message response = {0};
+        response.type = ECHO_SEND;
+        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+        snprintf(response.infos, INFOS_LEN, "User %.100s does not exist", msg->infos);
+        send_message(sender, &response, NULL);
+        return;
+    }
+
+    struct message forward = *msg;
+    safe_strcpy(forward.nick_sender, sender->nickname, NICK_LEN);
+    send_message(target, &forward, payload);
+    msglog_record(&forward, target->nickname, payload);
+}
+// Négociation du format de trame : la réponse part dans l'ancien format,
+// les trames suivantes (dans les deux sens) utilisent la version retenue
+void handle_proto_hello(Client *client, struct message *msg) {
+    int version = atoi(msg->infos);
+    if (version > WIRE_VERSION) version = WIRE_VERSION;
+    if (version < WIRE_LEGACY) version = WIRE_LEGACY;
+
+    // Une fois le pseudo enregistré, d'autres workers peuvent avoir des
+    // trames déjà encodées en route vers ce client : le format est figé
+    if (client->has_nickname) version = client->wire_version;
+
+    struct message response = {0};
+    response.type = PROTO_HELLO;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    // Le port du relais suit la version ; un ancien client s'arrête au chiffre
+    if (relay_port) {
+        snprintf(response.infos, INFOS_LEN, "%d relay=%s", version, relay_port);
+    } else {
+        snprintf(response.infos, INFOS_LEN, "%d", version);
+    }
+    send_message(client, &response, NULL);
+
+    client->wire_version = version;
+}
+
+// Mesures
+// Additionne les mesures de tous les workers dans total (alloué par l'appelant, à zéro)
+void metrics_collect(Metrics *total) {
+    for (int w = 0; w < worker_count; w++) {
+        Metrics *m = &workers[w].metrics;
+        for (int i = 0; i < MSG_TYPE_COUNT; i++) {
+            counter_add(&total->msgs_in[i], counter_get(&m->msgs_in[i]));
+            counter_add(&total->msgs_out[i], counter_get(&m->msgs_out[i]));
+        }
+        counter_add(&total->bytes_in, counter_get(&m->bytes_in));
+        counter_add(&total->bytes_out, counter_get(&m->bytes_out));
+        counter_add(&total->log_records, counter_get(&m->log_records));
+        counter_add(&total->log_commits, counter_get(&m->log_commits));
+        counter_add(&total->out_dropped, counter_get(&m->out_dropped));
+        counter_add(&total->out_coalesced, counter_get(&m->out_coalesced));
+        counter_add(&total->out_disconnects, counter_get(&m->out_disconnects));
+        counter_add(&total->socket_writes, counter_get(&m->socket_writes));
+        hist_merge(&total->loop_time, &m->loop_time);
+        hist_merge(&total->fanout, &m->fanout);
+        hist_merge(&total->queue_depth, &m->queue_depth);
+    }
+}
+
+uint64_t metrics_sum(Counter *counters) {
+    uint64_t sum = 0;
+    for (int i = 0; i < MSG_TYPE_COUNT; i++) sum += counter_get(&counters[i]);
+    return sum;
+}
+
+// Résumé tenant dans un payload ; réservé aux connexions locales
+void handle_stats_query(Client *client) {
+    struct message response = {0};
+    response.type = STATS_QUERY;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+
+    if (client->addr.sin_addr.s_addr != htonl(INADDR_LOOPBACK)) {
+        safe_strcpy(response.infos, "Statistics are only available locally", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+
+    Metrics *m = calloc(1, sizeof(Metrics));
+    if (!m) {
+        perror("calloc() metrics");
+        return;
+    }
+    metrics_collect(m);
+
+    char payload[MSG_LEN];
+    int len = snprintf(payload, MSG_LEN,
+        "clients %d, channels %d, workers %d\n"
+        "messages in %llu, out %llu\n"
+        "bytes in %llu, out %llu\n"
+        "loop us p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n"
+        "fanout p50 %llu, p99 %llu, max %llu\n"
+        "queue bytes p99 %llu, p999 %llu, max %llu\n",
+        client_manager.count, channel_manager.count, worker_count,
+        (unsigned long long)metrics_sum(m->msgs_in), (unsigned long long)metrics_sum(m->msgs_out),
+        (unsigned long long)counter_get(&m->bytes_in), (unsigned long long)counter_get(&m->bytes_out),
+        hist_percentile(&m->loop_time, 50) / 1e3, hist_percentile(&m->loop_time, 99) / 1e3,
+        hist_percentile(&m->loop_time, 99.9) / 1e3, counter_get(&m->loop_time.max) / 1e3,
+        (unsigned long long)hist_percentile(&m->fanout, 50),
+        (unsigned long long)hist_percentile(&m->fanout, 99),
+        (unsigned long long)counter_get(&m->fanout.max),
+        (unsigned long long)hist_percentile(&m->queue_depth, 99),
+        (unsigned long long)hist_percentile(&m->queue_depth, 99.9),
+        (unsigned long long)counter_get(&m->queue_depth.max));
+
+    // Détail par type, tant qu'il reste de la place
+    for (int i = 0; i < MSG_TYPE_COUNT && len < MSG_LEN; i++) {
+        uint64_t in = counter_get(&m->msgs_in[i]);
+        uint64_t out = counter_get(&m->msgs_out[i]);
+        if (in == 0 && out == 0) continue;
+        int n = snprintf(payload + len, MSG_LEN - len, "%s in %llu, out %llu\n",
+                         msg_type_str[i], (unsigned long long)in, (unsigned long long)out);
+        if (len + n >= MSG_LEN) {
+            payload[len] = '\0';
+            break;
+        }
+        len += n;
+    }
+    free(m);
+
+    if (len >= MSG_LEN) len = MSG_LEN - 1;
+    response.pld_len = len;
+    safe_strcpy(response.infos, "stats", INFOS_LEN);
+    send_message(client, &response, payload);
+}
+
+// Fédération : les serveurs liés forment un maillage complet. Chacun
+// annonce ses propres utilisateurs (SERVER_SYNC) et ne relaie que leurs
+// messages ; un utilisateur distant est représenté localement par un
+// client sans socket (ghost), rattaché à la liaison de son serveur.
+void link_sync(Client *link, Client *user, const char *op, const char *channel) {
+    if (link_count == 0) return;
+
+    struct message sync = {0};
+    sync.type = SERVER_SYNC;
+    safe_strcpy(sync.nick_sender, user->nickname, NICK_LEN);
+    if (channel) snprintf(sync.infos, INFOS_LEN, "%s %s", op, channel);
+    else safe_strcpy(sync.infos, op, INFOS_LEN);
+
+    Fanout fanout = { .msg = &sync };
+    if (link) {
+        fanout_send(&fanout, link);
+    } else {
+        for (int i = 0; i < link_count; i++) fanout_send(&fanout, links[i]);
+    }
+    fanout_release(&fanout);
+}
+
+// État complet, envoyé à l'établissement d'une liaison
+void link_send_state(Client *link) {
+    for (int i = 0; i < client_manager.count; i++) {
+        Client *user = client_manager.clients[i];
+        if (!user->has_nickname) continue;
+        link_sync(link, user, "nick", NULL);
+        if (user->channel) link_sync(link, user, "join", user->channel->name);
+    }
+}
+
+// Un utilisateur local perd son pseudo au profit d'un utilisateur distant
+void nickname_revoke(Client *client, Client *link) {
+    remove_from_current_channel(client);
+    link_sync(NULL, client, "gone", NULL);
+    name_index_remove(&client_manager.nicks, client);
+    client->has_nickname = 0;
+    client_manager.list.valid = 0;
+    log_warn("Nickname %s is also used on server %s, released", client->nickname, link->nickname);
+
+    struct message notice = {0};
+    notice.type = ECHO_SEND;
+    safe_strcpy(notice.nick_sender, "Server", NICK_LEN);
+    snprintf(notice.infos, INFOS_LEN, "Nickname %.20s is in use on server %.20s, please choose another with /nick",
+             client->nickname, link->nickname);
+    send_message(client, &notice, NULL);
+}
+
+void ghost_remove(Client *ghost) {
+    Client *link = ghost->link;
+    remove_from_current_channel(ghost);
+    name_index_remove(&client_manager.nicks, ghost);
+    if (ghost->ghost_prev) ghost->ghost_prev->ghost_next = ghost->ghost_next;
+    else link->ghosts = ghost->ghost_next;
+    if (ghost->ghost_next) ghost->ghost_next->ghost_prev = ghost->ghost_prev;
+    ghost_count--;
+    client_manager.list.valid = 0;
+    client_free(ghost);
+}
+
+// Deux serveurs qui annoncent le même pseudo : celui dont le nom est le
+// plus petit le garde, chaque serveur arrive seul à la même conclusion
+void ghost_add(Client *link, const char *nickname) {
+    if (!is_nickname_valid(nickname)) return;
+    Client *existing = find_client_by_nickname(nickname);
+    if (existing) {
+        if (existing->link == link) return;
+        const char *holder = existing->link ? existing->link->nickname : node_name;
+        if (strcmp(holder, link->nickname) < 0) return;
+        if (existing->link) ghost_remove(existing);
+        else nickname_revoke(existing, link);
+    }
+
+    Client *ghost = client_alloc();
+    if (!ghost) return;
+    ghost->fd = -1;
+    ghost->link = link;
+    ghost->owner = link->owner;
+    ghost->wire_version = link->wire_version;
+    ghost->connection_time = time(NULL);
+    safe_strcpy(ghost->nickname, nickname, NICK_LEN);
+    ghost->has_nickname = 1;
+    if (name_index_insert(&client_manager.nicks, ghost) == -1) {
+        client_free(ghost);
+        return;
+    }
+    ghost->ghost_next = link->ghosts;
+    if (link->ghosts) link->ghosts->ghost_prev = ghost;
+    link->ghosts = ghost;
+    ghost_count++;
+    client_manager.list.valid = 0;
+}
+
+void ghost_join(Client *ghost, const char *channel_name) {
+    if (!is_channel_name_valid(channel_name)) return;
+    Channel *channel = find_channel_by_name(channel_name);
+    if (ghost->channel == channel && channel) return;
+    remove_from_current_channel(ghost);
+    int created = 0;
+    if (!channel) {
+        channel = channel_create(channel_name);
+        if (!channel) return;
+        created = 1;
+    }
+    if (channel_add(channel, ghost) == -1) {
+        if (created) channel_destroy(channel);
+        return;
+    }
+
+    char notify_msg[INFOS_LEN];
+    snprintf(notify_msg, INFOS_LEN, "INFO> %.20s has joined %.20s", ghost->nickname, channel_name);
+    notify_channel(channel, notify_msg, ghost);
+}
+
+// Utilisateur distant annoncé par cette liaison, NULL sinon
+Client *link_ghost(Client *link, const char *nickname) {
+    Client *ghost = find_client_by_nickname(nickname);
+    return ghost && ghost->link == link ? ghost : NULL;
+}
+
+void handle_server_sync(Client *link, struct message *msg) {
+    char op[INFOS_LEN];
+    safe_strcpy(op, msg->infos, INFOS_LEN);
+    char *channel = strchr(op, ' ');
+    if (channel) *channel++ = '\0';
+
+    if (strcmp(op, "nick") == 0) {
+        ghost_add(link, msg->nick_sender);
+        return;
+    }
+    Client *ghost = link_ghost(link, msg->nick_sender);
+    if (!ghost) return;
+    if (strcmp(op, "gone") == 0) {
+        ghost_remove(ghost);
+    } else if (strcmp(op, "join") == 0 && channel) {
+        ghost_join(ghost, channel);
+    } else if (strcmp(op, "quit") == 0 && channel) {
+        if (ghost->channel && strcmp(ghost->channel->name, channel) == 0) {
+            remove_from_current_channel(ghost);
+        }
+    }
+}
+
+// Message d'un utilisateur distant, remis aux seuls clients locaux
+void handle_link_message(Client *link, struct message *msg, const char *payload) {
+    if (msg->type == SERVER_SYNC) {
+        handle_server_sync(link, msg);
+        return;
+    }
+
+    Client *sender = link_ghost(link, msg->nick_sender);
+    if (!sender) return;
+
+    switch (msg->type) {
+        case UNICAST_SEND:
+        case FILE_REQUEST:
+        case FILE_ACCEPT:
+        case FILE_REJECT:
+        case FILE_ACK: {
+            Client *target = find_client_by_nickname(msg->infos);
+            if (target && !target->link) handle_unicast(sender, msg, payload);
+            break;
+        }
+
+        case BROADCAST_SEND: {
+            Fanout fanout = { .msg = msg, .payload = payload };
+            for (int i = 0; i < client_manager.count; i++) {
+                if (client_manager.clients[i]->has_nickname) {
+                    fanout_send(&fanout, client_manager.clients[i]);
+                }
+            }
+            msglog_record(msg, "", payload);
+            fanout_release(&fanout);
+            break;
+        }
+
+        case MULTICAST_SEND: {
+            Channel *channel = sender->channel;
+            if (!channel || strcmp(channel->name, msg->infos) != 0) break;
+            Fanout fanout = { .msg = msg, .payload = payload };
+            for (int i = 0; i < channel->user_count; i++) {
+                if (!channel->users[i]->link) fanout_send(&fanout, channel->users[i]);
+            }
+            history_append(channel, &fanout);
+            msglog_record(msg, channel->name, payload);
+            fanout_release(&fanout);
+            break;
+        }
+
+        default:
+            log_warn("Unexpected message type from server %s: %s", link->nickname, msg_type_str[msg->type]);
+            break;
+    }
+}
+
+// Présentation d'un serveur : nom dans nick_sender, version du protocole
+// de liaison dans infos, clé partagée en payload. Envoyée dans l'ancien
+// format, comme la réponse à PROTO_HELLO.
+void link_send_hello(Client *client) {
+    struct message hello = {0};
+    hello.type = SERVER_LINK;
+    safe_strcpy(hello.nick_sender, node_name, NICK_LEN);
+    snprintf(hello.infos, INFOS_LEN, "%d", LINK_VERSION);
+    hello.pld_len = strlen(link_key) + 1;
+    send_message(client, &hello, link_key);
+}
+
+// Comparaison en temps constant : la durée ne renseigne pas sur la clé
+int link_key_matches(const char *key, size_t len) {
+    size_t expected = strlen(link_key) + 1;
+    unsigned char diff = len != expected;
+    for (size_t i = 0; i < expected; i++) {
+        diff |= (unsigned char)link_key[i] ^ (unsigned char)(i < len ? key[i] : 0);
+    }
+    return diff == 0;
+}
+
+void link_refuse(Client *client, const char *reason) {
+    struct message response = {0};
+    response.type = ECHO_SEND;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    snprintf(response.infos, INFOS_LEN, "Link refused: %s", reason);
+    send_message(client, &response, NULL);
+    close_after_flush(client);
+}
+
+void handle_server_link(Client *client, struct message *msg, const char *payload) {
+    const char *reason = NULL;
+    if (!link_key) reason = "federation is disabled";
+    else if (client->is_link || client->has_nickname) reason = "connection already in use";
+    else if (atoi(msg->infos) != LINK_VERSION) reason = "unsupported link version";
+    else if (!link_key_matches(payload, msg->pld_len > 0 ? msg->pld_len : 0)) reason = "wrong key";
+    else if (!is_nickname_valid(msg->nick_sender) || strcmp(msg->nick_sender, node_name) == 0) {
+        reason = "invalid server name";
+    } else if (link_count == MAX_LINKS) reason = "too many links";
+    for (int i = 0; !reason && i < link_count; i++) {
+        if (strcmp(links[i]->nickname, msg->nick_sender) == 0) reason = "server already linked";
+    }
+    if (reason) {
+        log_warn("Link from server %.20s refused: %s", msg->nick_sender, reason);
+        link_refuse(client, reason);
+        return;
+    }
+
+    // Le serveur appelé répond par sa propre présentation
+    if (!client->peer) link_send_hello(client);
+
+    safe_strcpy(client->nickname, msg->nick_sender, NICK_LEN);
+    client->is_link = 1;
+    client->wire_version = WIRE_VERSION;
+    links[link_count++] = client;
+    log_info("Linked to server %s", client->nickname);
+    link_send_state(client);
+}
+
+// Liaison perdue : ses utilisateurs disparaissent, la liaison sortante
+// sera retentée
+void link_drop(Client *client) {
+    if (client->peer) atomic_store(&client->peer->linked, 0);
+    if (!client->is_link) return;
+
+    int users = 0;
+    while (client->ghosts) {
+        ghost_remove(client->ghosts);
+        users++;
+    }
+    for (int i = 0; i < link_count; i++) {
+        if (links[i] == client) {
+            links[i] = links[--link_count];
+            break;
+        }
+    }
+    client->is_link = 0;
+    log_warn("Link to server %s lost (%d remote users)", client->nickname, users);
+}
+
+void handle_client_message(int fd, struct message *msg, const char *payload) {
+    Client *client = find_client_by_fd(fd);
+    if (!client) return;
+
+    if ((int)msg->type < 0 || (int)msg->type >= MSG_TYPE_COUNT) {
+        log_warn("Unknown message type: %d", msg->type);
+        return;
+    }
+    counter_add(&worker_metrics()->msgs_in[msg->type], 1);
+
+    if (msg->type == PROTO_HELLO) {
+        handle_proto_hello(client, msg);
+        return;
+    }
+
+    if (msg->type == SERVER_LINK) {
+        handle_server_link(client, msg, payload);
+        return;
+    }
+    if (client->is_link) {
+        handle_link_message(client, msg, payload);
+        return;
+    }
+    // Liaison sortante en attente de la réponse : un refus arrive en ECHO_SEND
+    if (client->peer) {
+        if (msg->type == ECHO_SEND && strncmp(msg->infos, "Link refused", 12) == 0) {
+            log_warn("Server %s:%s: %s", client->peer->host, client->peer->port, msg->infos);
+        }
+        return;
+    }
+
+    // Requête d'administration, permise avant le pseudo
+    if (msg->type == STATS_QUERY) {
+        handle_stats_query(client);
+        return;
+    }
+    
+    if (!client->has_nickname && msg->type != NICKNAME_NEW) {
+        struct message response = {0};
+        response.type = ECHO_SEND;
+        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+        safe_strcpy(response.infos, "Please set your nickname using /nick <pseudo>", INFOS_LEN);
+        send_message(client, &response, NULL);
+        return;
+    }
+    
+    switch (msg->type) {
+        case NICKNAME_NEW:
+            handle_nickname_new(client, msg);
+            break;
+            
+        case NICKNAME_LIST:
+            handle_nickname_list(client, msg->infos);
+            break;
+            
+        case NICKNAME_INFOS:
+            handle_nickname_infos(client, msg);
+            break;
+            
+        case BROADCAST_SEND:
+            handle_broadcast(client, msg, payload);
+            break;
+            
+        case UNICAST_SEND:
+            handle_unicast(client, msg, payload);
+            break;
+            
+        case MULTICAST_CREATE:
+            handle_channel_create(client, msg->infos);
+            break;
+            
+        case MULTICAST_LIST:
+            handle_channel_list(client, msg->infos);
+            break;
+            
+        case MULTICAST_JOIN:
+            handle_channel_join(client, msg->infos);
+            break;
+            
+        case MULTICAST_QUIT:
+            handle_channel_quit(client, msg->infos);
+            break;
+            
+        case MULTICAST_SEND:
+        case ECHO_SEND:
+            handle_channel_message(client, payload);
+            break;
+        case FILE_REQUEST:
+        case FILE_ACCEPT:
+        case FILE_REJECT:
+        case FILE_ACK:
+            handle_unicast(client, msg, payload);
+            break;
+            
+        default:
+            log_warn("Unexpected message type: %s", msg_type_str[msg->type]);
+            break;
+    }
+}
+
+// Boucle d'événements
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl()");
+        return -1;
+    }
+    return 0;
+}
+
+// Avec epoll, chaque socket est enregistrée une seule fois (mode edge-triggered)
+int loop_register(Worker *worker, int fd) {
+    if (loop_backend != BACKEND_EPOLL) return 0;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl(ADD)");
+        return -1;
+    }
+    return 0;
+}
+
+// La file de sortie n'est surveillée en écriture que lorsqu'elle n'est pas vide
+void set_write_interest(Client *client, int enable) {
+    if (client->want_write == enable) return;
+    client->want_write = enable;
+    if (loop_backend != BACKEND_EPOLL) return;
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (enable ? EPOLLOUT : 0);
+    ev.data.fd = client->fd;
+    if (epoll_ctl(client->owner->epfd, EPOLL_CTL_MOD, client->fd, &ev) == -1) {
+        perror("epoll_ctl(MOD)");
+    }
+}
+
+void loop_unregister(Worker *worker, int fd) {
+    if (loop_backend != BACKEND_EPOLL) return;
+
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+        perror("epoll_ctl(DEL)");
+    }
+}
+
+void remove_client(int fd) {
+    Client *client = find_client_by_fd(fd);
+    if (!client) return;
+
+    if (client->is_link || client->peer) link_drop(client);
+    remove_from_current_channel(client);
+    
+    log_info("Client %s disconnected",
+             client->has_nickname ? client->nickname : "unknown");
+    
+    if (client->has_nickname) {
+        link_sync(NULL, client, "gone", NULL);
+        name_index_remove(&client_manager.nicks, client);
+        client_manager.list.valid = 0;
+    }
+    client->owner->by_fd[fd] = NULL;
+    if (client->dirty) client->owner->dirty[client->dirty - 1] = NULL;
+    client->dirty = 0;
+    loop_unregister(client->owner, fd);
+    out_queue_clear(&client->out);
+    out_queue_clear(&client->held);
+    free(client->partial);
+    // La réception multishot tient une référence sur la socket : shutdown()
+    // la termine, close() seul ne suffirait pas
+    if (loop_backend == BACKEND_URING) shutdown(fd, SHUT_RDWR);
+    close(fd);
+    
+    client_list_remove(client);
+    client_free(client);
+}
+
+// Enregistre la connexion auprès du worker courant ; NULL si elle a dû être fermée
+Client *client_register(int fd, struct sockaddr_in addr) {
+    // io_uring attend lui-même que la socket soit prête : elle reste bloquante
+    if ((loop_backend != BACKEND_URING && set_nonblocking(fd) == -1) ||
+        loop_register(current_worker, fd) == -1) {
+        close(fd);
+        return NULL;
+    }
+    
+    // client_alloc() remet la case à zéro
+    Client *client = client_alloc();
+    if (!client || client_list_add(client) == -1) {
+        if (client) client_free(client);
+        loop_unregister(current_worker, fd);
+        close(fd);
+        return NULL;
+    }
+    if (fd_table_set(fd, client) == -1) {
+        client_list_remove(client);
+        client_free(client);
+        loop_unregister(current_worker, fd);
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+    client->id = next_client_id++;
+    client->owner = current_worker;
+    client->wire_version = WIRE_LEGACY;
+    client->addr = addr;
+    client->connection_time = time(NULL);
+#ifdef WITH_IO_URING
+    if (loop_backend == BACKEND_URING) uring_arm_recv(client);
+#endif
+    return client;
+}
+
+void add_client(int fd, struct sockaddr_in addr) {
+    Client *client = client_register(fd, addr);
+    if (!client) return;
+    
+    char ip_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(addr.sin_addr), ip_str, INET_ADDRSTRLEN);
+    log_info("New client connected from %s:%d", ip_str, ntohs(addr.sin_port));
+    
+    struct message welcome = {0};
+    welcome.type = ECHO_SEND;
+    safe_strcpy(welcome.nick_sender, "Server", NICK_LEN);
+    safe_strcpy(welcome.infos, "Please login with /nick <your pseudo>", INFOS_LEN);
+    send_message(client, &welcome, NULL);
+}
+
+// La socket d'écoute est non bloquante : on accepte jusqu'à EAGAIN
+void accept_clients(int listen_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int new_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+        if (new_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept()");
+            }
+            return;
+        }
+
+        pthread_mutex_lock(&state_lock);
+        add_client(new_fd, client_addr);
+        pthread_mutex_unlock(&state_lock);
+    }
+}
+
+int client_keep_partial(Client *client, WireBuffer *in) {
+    size_t len = in->end - in->start;
+    if (len == 0) {
+        free(client->partial);
+        client->partial = NULL;
+        client->partial_len = 0;
+        return 0;
+    }
+
+    if (len > client->partial_len) {
+        unsigned char *partial = realloc(client->partial, len);
+        if (!partial) {
+            perror("realloc() partial frame");
+            return -1;
+        }
+        client->partial = partial;
+    }
+    memcpy(client->partial, in->data + in->start, len);
+    client->partial_len = len;
+    return 0;
+}
+
+void drop_client(int fd) {
+    pthread_mutex_lock(&state_lock);
+    remove_client(fd);
+    pthread_mutex_unlock(&state_lock);
+}
+
+// Traite toutes les trames complètes de in (sous state_lock) ; retourne -1
+// si le client a été retiré
+int handle_client_input(int fd, WireBuffer *in) {
+    Client *client;
+    while (1) {
+        // Le format peut changer d'une trame à l'autre (PROTO_HELLO)
+        client = find_client_by_fd(fd);
+        if (!client) break;
+
+        struct message msg;
+        char payload[MSG_LEN];
+        int ret = wire_buffer_next(in, client->wire_version, &msg, payload);
+        if (ret == 0) break;
+        if (ret < 0) {
+            log_warn("Malformed frame from client %d", fd);
+            remove_client(fd);
+            return -1;
+        }
+        handle_client_message(fd, &msg, payload);
+    }
+
+    // Le reste (une trame incomplète, au plus) est recopié dans le client :
+    // seules les connexions en milieu de trame occupent de la mémoire
+    if (client && client_keep_partial(client, in) == -1) {
+        remove_client(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Une seule lecture remplit le tampon du worker, précédé de la trame
+// partielle éventuellement mise de côté pour ce client, puis toutes les
+// trames complètes sont traitées. Retourne READ_FULL si le tampon a été
+// rempli (il peut rester des données), READ_SHORT si la socket a été vidée,
+// READ_AGAIN s'il n'y avait rien à lire et -1 si le client a été retiré.
+int read_client_input(int fd) {
+    WireBuffer *in = &current_worker->in;
+
+    // Seul le worker propriétaire touche à partial : la lecture se fait hors
+    // verrou, state_lock n'est pris que pour traiter les trames reçues
+    Client *client = find_client_by_fd(fd);
+    if (!client) return -1;
+    in->start = 0;
+    in->end = client->partial_len;
+    if (client->partial_len > 0) memcpy(in->data, client->partial, client->partial_len);
+
+    size_t room = WIRE_BUF_SIZE - in->end;
+    ssize_t rec = recv(fd, in->data + in->end, room, 0);
+    if (rec < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return READ_AGAIN;
+    }
+    if (rec <= 0) {
+        if (rec == 0) log_debug("Connection %d closed by peer", fd);
+        else log_warn("recv() on connection %d: %s", fd, strerror(errno));
+        drop_client(fd);
+        return -1;
+    }
+    in->end += rec;
+    counter_add(&worker_metrics()->bytes_in, rec);
+
+    pthread_mutex_lock(&state_lock);
+    int ret = handle_client_input(fd, in);
+    pthread_mutex_unlock(&state_lock);
+    if (ret == -1) return -1;
+
+    return (size_t)rec == room ? READ_FULL : READ_SHORT;
+}
+
+void flush_client_fd(int fd) {
+    Client *client = find_client_by_fd(fd);
+    if (client) flush_client(client);
+}
+
+// Délivre les messages postés par les autres workers
+void drain_mailbox(Worker *worker) {
+    uint64_t count;
+    if (read(worker->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read() eventfd");
+    }
+
+    // La pile est récupérée d'un bloc puis inversée pour garder l'ordre d'envoi
+    MailboxItem *item = atomic_exchange(&worker->mailbox, NULL);
+    MailboxItem *ordered = NULL;
+    while (item) {
+        MailboxItem *next = item->next;
+        item->next = ordered;
+        ordered = item;
+        item = next;
+    }
+
+    // Les trames ne touchent que les files des clients du worker : seule
+    // l'adoption d'une liaison modifie l'état partagé
+    while (ordered) {
+        MailboxItem *next = ordered->next;
+        if (ordered->peer) {
+            pthread_mutex_lock(&state_lock);
+            link_adopt(ordered->fd, ordered->peer);
+            pthread_mutex_unlock(&state_lock);
+        } else {
+            Client *target = find_client_by_fd(ordered->fd);
+            if (target && target->id == ordered->client_id) {
+                if (ordered->kind == MAILBOX_REPLAY_END) replay_end(target);
+                else if (ordered->kind == MAILBOX_REPLAY) queue_buf_now(target, ordered->buf);
+                else queue_buf(target, ordered->buf);
+            }
+            if (ordered->buf) outbuf_release(ordered->buf);
+        }
+        free(ordered);
+        ordered = next;
+    }
+}
+
+// Journal persistant des messages
+typedef struct MsgLogQuery {
+    struct MsgLogQuery *next;
+    char channel[CHANNEL_NAME_LEN];
+    uint64_t before;  // Messages antérieurs à l'arrivée du client seulement
+    Worker *owner;
+    int fd;
+    unsigned long client_id;
+    int wire_version;
+    MailboxItem *done;  // Fin de relecture, allouée d'avance : elle arrive toujours
+} MsgLogQuery;
+
+// Message retenu parmi les plus récents du salon ; n'est encodé qu'une
+// fois la sélection terminée
+typedef struct {
+    uint64_t seq;
+    int segment;  // Indice dans la liste des segments parcourus
+    size_t off;   // Position de l'enregistrement dans le segment
+} MsgLogHit;
+
+MsgLogQuery *msglog_queries;  // Sous msglog_lock, dans l'ordre inverse d'arrivée
+pthread_mutex_t msglog_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t msglog_cond = PTHREAD_COND_INITIALIZER;
+
+// Ajoute le message au lot du worker courant (sous state_lock, qui ordonne les séquences)
+void msglog_record(struct message *msg, const char *target, const char *payload) {
+    if (!msglog_dir) return;
+    size_t pld_len = (msg->pld_len > 0 && payload != NULL) ? msg->pld_len : 0;
+    if (msglog_append(&current_worker->msglog, msglog_seq, msg->type, msg->nick_sender,
+                      target, payload, pld_len) == 0) {
+        msglog_seq++;
+    }
+}
+
+// Fin d'itération : un seul write() et un seul fdatasync() pour tout le lot
+void msglog_flush(Worker *worker) {
+    if (!msglog_dir) return;
+    int records = msglog_commit(&worker->msglog);
+    if (records > 0) {
+        counter_add(&worker->metrics.log_records, records);
+        counter_add(&worker->metrics.log_commits, 1);
+    } else if (records < 0) {
+        log_error("Message log commit failed, batch lost");
+    }
+}
+
+// La relecture se fait dans le thread du journal ; les trames reviennent
+// au client par la boîte aux lettres de son worker
+void msglog_query(Client *client, Channel *channel) {
+    if (!msglog_dir) return;
+
+    MsgLogQuery *query = malloc(sizeof(MsgLogQuery));
+    MailboxItem *done = calloc(1, sizeof(MailboxItem));
+    if (!query || !done) {
+        perror("malloc() message log query");
+        free(query);
+        free(done);
+        return;
+    }
+    done->kind = MAILBOX_REPLAY_END;
+    done->fd = client->fd;
+    done->client_id = client->id;
+    query->done = done;
+    safe_strcpy(query->channel, channel->name, CHANNEL_NAME_LEN);
+    query->before = msglog_seq;
+    query->owner = client->owner;
+    query->fd = client->fd;
+    query->client_id = client->id;
+    query->wire_version = client->wire_version;
+    // Jusqu'à la fin de la relecture, les trames du client sont retenues
+    client->replaying++;
+
+    pthread_mutex_lock(&msglog_lock);
+    query->next = msglog_queries;
+    msglog_queries = query;
+    pthread_cond_signal(&msglog_cond);
+    pthread_mutex_unlock(&msglog_lock);
+}
+
+// Parcourt un segment projeté et garde dans hits les MSGLOG_QUERY_MAX
+// messages du salon les plus récents
+void msglog_scan(const unsigned char *base, size_t size, int segment, MsgLogQuery *query,
+                 MsgLogHit *hits, int *count) {
+    size_t off = 0;
+    size_t name_len = strlen(query->channel);
+    MsgLogEntry entry;
+    while (1) {
+        size_t record = off;
+        if (!msglog_next(base, size, &off, &entry)) break;
+        if (entry.type != MULTICAST_SEND || entry.seq >= query->before ||
+            entry.target_len != name_len || memcmp(entry.target, query->channel, name_len) != 0) {
+            continue;
+        }
+
+        int slot = *count;
+        if (*count == MSGLOG_QUERY_MAX) {
+            slot = 0;
+            for (int i = 1; i < *count; i++) {
+                if (hits[i].seq < hits[slot].seq) slot = i;
+            }
+            if (hits[slot].seq > entry.seq) continue;
+        } else {
+            (*count)++;
+        }
+        hits[slot].seq = entry.seq;
+        hits[slot].segment = segment;
+        hits[slot].off = record;
+    }
+}
+
+// Encode les messages retenus dans ce segment, projeté une seule fois
+void msglog_encode(const char *name, int segment, MsgLogQuery *query,
+                   MsgLogHit *hits, OutBuf **bufs, int count) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", msglog_dir, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    size_t size = 0;
+    const unsigned char *base = msglog_map(fd, &size);
+    close(fd);
+    if (!base) return;
+
+    for (int i = 0; i < count; i++) {
+        size_t off = hits[i].off;
+        MsgLogEntry entry;
+        if (hits[i].segment != segment || !msglog_next(base, size, &off, &entry)) continue;
+        struct message msg = {0};
+        msg.type = MULTICAST_SEND;
+        memcpy(msg.nick_sender, entry.sender, entry.sender_len < NICK_LEN ? entry.sender_len : NICK_LEN - 1);
+        safe_strcpy(msg.infos, query->channel, INFOS_LEN);
+        msg.pld_len = entry.payload_len;
+        bufs[i] = outbuf_encode(query->wire_version, &msg, entry.payload);
+    }
+    munmap((void *)base, size);
+}
+
+void msglog_answer(MsgLogQuery *query) {
+    MsgLogHit hits[MSGLOG_QUERY_MAX];
+    int count = 0;
+    char **segments = NULL;
+    int segment_count = 0;
+
+    DIR *dir = opendir(msglog_dir);
+    if (!dir) {
+        perror("opendir() message log");
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!msglog_is_segment(ent->d_name)) continue;
+        char **grown = realloc(segments, (segment_count + 1) * sizeof(char *));
+        if (!grown) {
+            perror("realloc() message log segments");
+            break;
+        }
+        segments = grown;
+        segments[segment_count] = strdup(ent->d_name);
+        if (!segments[segment_count]) break;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", msglog_dir, ent->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            free(segments[segment_count]);
+            continue;
+        }
+        size_t size = 0;
+        const unsigned char *base = msglog_map(fd, &size);
+        close(fd);
+        if (!base) {
+            free(segments[segment_count]);
+            continue;
+        }
+        msglog_scan(base, size, segment_count, query, hits, &count);
+        munmap((void *)base, size);
+        segment_count++;
+    }
+    closedir(dir);
+
+    // Les segments de plusieurs workers s'entrelacent : remise dans l'ordre des séquences
+    for (int i = 1; i < count; i++) {
+        MsgLogHit hit = hits[i];
+        int j = i;
+        for (; j > 0 && hits[j - 1].seq > hit.seq; j--) hits[j] = hits[j - 1];
+        hits[j] = hit;
+    }
+
+    // Seuls les messages retenus sont encodés, segment par segment
+    OutBuf *bufs[MSGLOG_QUERY_MAX] = {0};
+    for (int segment = 0; segment < segment_count; segment++) {
+        for (int i = 0; i < count; i++) {
+            if (hits[i].segment == segment) {
+                msglog_encode(segments[segment], segment, query, hits, bufs, count);
+                break;
+            }
+        }
+        free(segments[segment]);
+    }
+    free(segments);
+
+    int sent = 0;
+    for (int i = 0; i < count; i++) {
+        if (!bufs[i]) continue;
+        mailbox_post_replay(query->owner, query->fd, query->client_id, bufs[i]);
+        outbuf_release(bufs[i]);
+        sent++;
+    }
+    log_debug("Replayed %d logged messages of %s", sent, query->channel);
+}
+
+void *msglog_reader(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&msglog_lock);
+        while (!msglog_queries) pthread_cond_wait(&msglog_cond, &msglog_lock);
+        MsgLogQuery *queries = msglog_queries;
+        msglog_queries = NULL;
+        pthread_mutex_unlock(&msglog_lock);
+
+        // Remise dans l'ordre d'arrivée
+        MsgLogQuery *ordered = NULL;
+        while (queries) {
+            MsgLogQuery *next = queries->next;
+            queries->next = ordered;
+            ordered = queries;
+            queries = next;
+        }
+        while (ordered) {
+            MsgLogQuery *next = ordered->next;
+            msglog_answer(ordered);
+            mailbox_push(ordered->owner, ordered->done);
+            free(ordered);
+            ordered = next;
+        }
+    }
+    return NULL;
+}
+
+// Avant le démarrage des workers : vérifie les segments, coupe une fin
+// d'écriture interrompue et reprend la numérotation
+int start_msglog(void) {
+    MsgLogRecovery recovery;
+    if (msglog_recover(msglog_dir, &recovery) == -1) return -1;
+    msglog_seq = recovery.next_seq;
+    log_info("Message log %s: %llu messages in %d segment(s)", msglog_dir,
+             (unsigned long long)recovery.records, recovery.segments);
+    if (recovery.truncated > 0) {
+        log_warn("Message log: dropped %llu bytes of incomplete records",
+                 (unsigned long long)recovery.truncated);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, msglog_reader, NULL) != 0) {
+        perror("pthread_create() message log");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void echo_server_poll(Worker *worker) {
+    struct pollfd *fds = NULL;
+    int fds_size = 0;
+    int nfds = 2;
+
+    while (1) {
+        // Le tableau suit le nombre de clients connectés
+        if (client_manager.count + 2 > fds_size) {
+            int size = fds_size ? fds_size : CLIENT_SLAB_SIZE;
+            while (size < client_manager.count + 2) size *= 2;
+            struct pollfd *table = realloc(fds, size * sizeof(struct pollfd));
+            if (!table) {
+                perror("realloc() pollfd array");
+                break;
+            }
+            fds = table;
+            fds_size = size;
+        }
+
+        // La boîte aux lettres reçoit les trames du journal et du relais
+        fds[0].fd = worker->listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = worker->wake_fd;
+        fds[1].events = POLLIN;
+        for (int i = 0; i < client_manager.count; i++) {
+            fds[i + 2].fd = client_manager.clients[i]->fd;
+            fds[i + 2].events = POLLIN | (client_manager.clients[i]->want_write ? POLLOUT : 0);
+        }
+        nfds = client_manager.count + 2;
+
+        int poll_count = poll(fds, nfds, POLL_TIMEOUT);
+        if (poll_count < 0) {
+            if (errno == EINTR) continue;
+            perror("poll()");
+            break;
+        }
+        uint64_t start = now_ns();
+        if (fds[0].revents & POLLIN) {
+            accept_clients(worker->listen_fd);
+        }
+        if (fds[1].revents & POLLIN) {
+            drain_mailbox(worker);
+        }
+
+        for (int i = 2; i < nfds; i++) {
+            if (fds[i].revents & POLLOUT) {
+                flush_client_fd(fds[i].fd);
+            }
+            // Level-triggered : une lecture par réveil, le reste attendra le suivant
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_client_input(fds[i].fd);
+            }
+        }
+        // Lot du journal de l'itération, puis écritures groupées
+        msglog_flush(worker);
+        flush_dirty(worker);
+        hist_record(&worker->metrics.loop_time, now_ns() - start);
+    }
+    free(fds);
+}
+
+// Seules les sockets prêtes sont visitées ; en edge-triggered il faut
+// vider chaque socket avant de rendre la main à epoll_wait()
+void echo_server_epoll(Worker *worker) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(worker->epfd, events, MAX_EVENTS, POLL_TIMEOUT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait()");
+            break;
+        }
+        uint64_t start = now_ns();
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == worker->listen_fd) {
+                accept_clients(worker->listen_fd);
+                continue;
+            }
+            if (fd == worker->wake_fd) {
+                drain_mailbox(worker);
+                continue;
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                flush_client_fd(fd);
+            }
+            // Une lecture courte signifie que la socket est vide ; après une
+            // fin de connexion on lit jusqu'à voir EOF, aucun autre front ne viendra
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                int hangup = events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+                int ret;
+                do {
+                    ret = read_client_input(fd);
+                } while (ret == READ_FULL || (ret == READ_SHORT && hangup));
+            }
+        }
+        // Lot du journal de l'itération, puis écritures groupées
+        msglog_flush(worker);
+        flush_dirty(worker);
+        hist_record(&worker->metrics.loop_time, now_ns() - start);
+    }
+}
+
+#ifdef WITH_IO_URING
+// Boucle io_uring : accept et recv multishot, envois groupés. user_data
+// porte le type d'opération dans ses 3 bits de poids faible.
+#define URING_OP_ACCEPT 1
+#define URING_OP_WAKE 2
+#define URING_OP_RECV 3  // (id du client sur 32 bits) << 32 | fd << 3
+#define URING_OP_SEND 4  // Adresse d'un UringSend
+#define URING_OP_MASK 7
+
+// Envoi en cours : garde ses trames en vie même si la file est vidée entre-temps
+typedef struct {
+    int fd;
+    unsigned long client_id;
+    int count;
+    struct msghdr hdr;
+    struct iovec iov[URING_SEND_IOV];
+    OutBuf *bufs[URING_SEND_IOV];
+} UringSend;
+
+int uring_arm(Worker *worker, int op, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&worker->ring);
+    if (!sqe) {
+        log_error("io_uring submission queue full");
+        return -1;
+    }
+    if (op == URING_OP_ACCEPT) uring_prep_accept_multishot(sqe, fd, URING_OP_ACCEPT);
+    else uring_prep_poll_multishot(sqe, fd, POLLIN, URING_OP_WAKE);
+    return 0;
+}
+
+void uring_arm_recv(Client *client) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&client->owner->ring);
+    if (!sqe) {
+        log_error("io_uring submission queue full, dropping client %d", client->fd);
+        mark_closing(client);
+        return;
+    }
+    uint64_t user_data = (uint64_t)(uint32_t)client->id << 32 | (uint64_t)client->fd << 3 | URING_OP_RECV;
+    uring_prep_recv_multishot(sqe, client->fd, client->owner->bufs.bgid, user_data);
+}
+
+// Un seul envoi à la fois par client, pour garder l'ordre des trames ; la
+// suite part à sa complétion
+void uring_send(Client *client) {
+    OutQueue *queue = &client->out;
+    if (queue->pinned > 0 || client->closing) return;
+    if (!queue->head) {
+        if (client->close_after_flush) mark_closing(client);
+        return;
+    }
+
+    UringSend *send = malloc(sizeof(UringSend));
+    if (!send) {
+        perror("malloc() io_uring send");
+        return;
+    }
+    send->fd = client->fd;
+    send->client_id = client->id;
+    send->count = 0;
+    OutChunk *chunk = queue->head;
+    for (; chunk && send->count < URING_SEND_IOV; chunk = chunk->next) {
+        send->iov[send->count].iov_base = chunk->buf->data + chunk->off;
+        send->iov[send->count].iov_len = chunk->buf->len - chunk->off;
+        send->bufs[send->count] = outbuf_retain(chunk->buf);
+        send->count++;
+    }
+    memset(&send->hdr, 0, sizeof(send->hdr));
+    send->hdr.msg_iov = send->iov;
+    send->hdr.msg_iovlen = send->count;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&client->owner->ring);
+    if (!sqe) {
+        log_error("io_uring submission queue full, dropping client %d", client->fd);
+        for (int i = 0; i < send->count; i++) outbuf_release(send->bufs[i]);
+        free(send);
+        mark_closing(client);
+        return;
+    }
+    int flags = MSG_NOSIGNAL | ((cork_output && chunk) ? MSG_MORE : 0);
+    uring_prep_sendmsg(sqe, client->fd, &send->hdr, flags, (uint64_t)(uintptr_t)send | URING_OP_SEND);
+    queue->pinned = send->count;
+    counter_add(&worker_metrics()->socket_writes, 1);
+}
+
+void uring_send_complete(int res, UringSend *send) {
+    Client *client = find_client_by_fd(send->fd);
+    // Client parti, ou file vidée par mark_closing() : rien à retirer
+    if (client && client->id == send->client_id && client->out.pinned > 0) {
+        client->out.pinned = 0;
+        if (res < 0) {
+            log_warn("sendmsg() on connection %d: %s", client->fd, strerror(-res));
+            mark_closing(client);
+        } else {
+            out_queue_consume(&client->out, res);
+            if (!out_queue_over(&client->out, 1)) client->over_since = 0;
+            uring_send(client);
+        }
+    }
+
+    for (int i = 0; i < send->count; i++) outbuf_release(send->bufs[i]);
+    free(send);
+}
+
+void uring_recv_complete(Worker *worker, struct io_uring_cqe *cqe) {
+    int fd = (int)((cqe->user_data & 0xFFFFFFFFu) >> 3);
+    uint32_t id = (uint32_t)(cqe->user_data >> 32);
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    Client *client = find_client_by_fd(fd);
+    if (client && (uint32_t)client->id != id) client = NULL;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (client && cqe->res > 0) {
+            // Même traitement qu'après recv() : trame partielle, puis données reçues
+            WireBuffer *in = &worker->in;
+            in->start = 0;
+            in->end = client->partial_len;
+            if (client->partial_len > 0) memcpy(in->data, client->partial, client->partial_len);
+            memcpy(in->data + in->end, uring_buf_data(&worker->bufs, bid), cqe->res);
+            in->end += cqe->res;
+            counter_add(&worker->metrics.bytes_in, cqe->res);
+            pthread_mutex_lock(&state_lock);
+            if (handle_client_input(fd, in) == -1) client = NULL;
+            pthread_mutex_unlock(&state_lock);
+        }
+        uring_buf_recycle(&worker->bufs, bid);
+    }
+
+    // Fin de la réception multishot : fin de connexion, erreur ou plus de
+    // tampon libre (-ENOBUFS, on relance)
+    if (client && !more) {
+        if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS)) {
+            if (cqe->res < 0) log_warn("recv() on connection %d: %s", fd, strerror(-cqe->res));
+            else log_debug("Connection %d closed by peer", fd);
+            drop_client(fd);
+        } else if (find_client_by_fd(fd) == client) {
+            uring_arm_recv(client);
+        }
+    }
+}
+
+void uring_accept_complete(Worker *worker, struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        getpeername(cqe->res, (struct sockaddr *)&addr, &addr_len);
+        pthread_mutex_lock(&state_lock);
+        add_client(cqe->res, addr);
+        pthread_mutex_unlock(&state_lock);
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        log_warn("accept() via io_uring: %s", strerror(-cqe->res));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm(worker, URING_OP_ACCEPT, worker->listen_fd);
+}
+
+// Appelée par le thread du worker : avec IORING_SETUP_SINGLE_ISSUER, seul
+// le créateur de l'anneau peut y soumettre
+int worker_init_uring(Worker *worker) {
+    // Un seul thread soumet : le noyau peut différer son travail jusqu'à io_uring_enter()
+    if (uring_init(&worker->ring, URING_ENTRIES, URING_CQ_ENTRIES,
+                   IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN) == -1 &&
+        uring_init(&worker->ring, URING_ENTRIES, URING_CQ_ENTRIES, 0) == -1) {
+        perror("io_uring_setup()");
+        return -1;
+    }
+    if (uring_buf_ring_init(&worker->ring, &worker->bufs, URING_BUF_COUNT, URING_BUF_SIZE, 0) == -1) {
+        perror("io_uring_register(PBUF_RING)");
+        return -1;
+    }
+
+    if (uring_arm(worker, URING_OP_ACCEPT, worker->listen_fd) == -1 ||
+        uring_arm(worker, URING_OP_WAKE, worker->wake_fd) == -1) {
+        return -1;
+    }
+    return 0;
+}
+// Un seul io_uring_enter() par itération soumet les envois préparés à la
+// fin de la précédente et attend les complétions suivantes
+void echo_server_uring(Worker *worker) {
+    if (worker_init_uring(worker) == -1) exit(EXIT_FAILURE);
+
+    while (1) {
+        if (uring_submit_and_wait(&worker->ring, 1) < 0) {
+            if (errno == EINTR) continue;
+            perror("io_uring_enter()");
+            break;
+        }
+        uint64_t start = now_ns();
+
+        struct io_uring_cqe *entry;
+        while ((entry = uring_peek_cqe(&worker->ring)) != NULL) {
+            // Copiée puis rendue : les traitements peuvent préparer de nouvelles SQE
+            struct io_uring_cqe cqe = *entry;
+            uring_cqe_seen(&worker->ring);
+
+            switch (cqe.user_data & URING_OP_MASK) {
+                case URING_OP_ACCEPT:
+                    uring_accept_complete(worker, &cqe);
+                    break;
+                case URING_OP_WAKE:
+                    drain_mailbox(worker);
+                    if (!(cqe.flags & IORING_CQE_F_MORE)) uring_arm(worker, URING_OP_WAKE, worker->wake_fd);
+                    break;
+                case URING_OP_RECV:
+                    uring_recv_complete(worker, &cqe);
+                    break;
+                case URING_OP_SEND:
+                    uring_send_complete(cqe.res, (UringSend *)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK));
+                    break;
+            }
+        }
+
+        // Lot du journal de l'itération, puis écritures groupées
+        msglog_flush(worker);
+        flush_dirty(worker);
+        hist_record(&worker->metrics.loop_time, now_ns() - start);
+    }
+}
+
+#endif
+
+int worker_init(Worker *worker) {
+    msglog_writer_init(&worker->msglog, msglog_dir, worker->id);
+    // Tous les backends ont une boîte aux lettres, créée avant le démarrage
+    // du worker (liaisons sortantes)
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (worker->wake_fd == -1) {
+        perror("eventfd()");
+        return -1;
+    }
+    // io_uring : socket d'écoute bloquante, l'anneau est créé par le worker lui-même
+    if (loop_backend == BACKEND_URING) return 0;
+    if (set_nonblocking(worker->listen_fd) == -1) return -1;
+    if (loop_backend != BACKEND_EPOLL) return 0;
+
+    worker->epfd = epoll_create1(0);
+    if (worker->epfd == -1) {
+        perror("epoll_create1()");
+        return -1;
+    }
+
+    int fds[2] = { worker->listen_fd, worker->wake_fd };
+    for (int i = 0; i < 2; i++) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fds[i];
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+            perror("epoll_ctl(listen)");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void *echo_server(void *arg) {
+    Worker *worker = arg;
+    current_worker = worker;
+    log_worker = worker->id;
+
+    static const char *backend_names[] = { "poll", "epoll", "io_uring" };
+    log_info("Worker %d is ready for connections (%s)...", worker->id, backend_names[loop_backend]);
+
+    if (loop_backend == BACKEND_EPOLL) {
+        echo_server_epoll(worker);
+#ifdef WITH_IO_URING
+    } else if (loop_backend == BACKEND_URING) {
+        echo_server_uring(worker);
+#endif
+    } else {
+        echo_server_poll(worker);
+    }
+    return NULL;
+}
+
+// Export Prometheus (format texte 0.0.4)
+void write_counter_by_type(FILE *out, const char *name, const char *help, Counter *counters) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < MSG_TYPE_COUNT; i++) {
+        fprintf(out, "%s{type=\"%s\"} %llu\n", name, msg_type_str[i],
+                (unsigned long long)counter_get(&counters[i]));
+    }
+}
+
+// scale convertit les valeurs enregistrées dans l'unité exportée
+void write_summary(FILE *out, const char *name, const char *labels, Histogram *hist, double scale) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} %g\n", name, labels, *labels ? "," : "",
+                quantiles[i], hist_percentile(hist, quantiles[i] * 100) * scale);
+    }
+    const char *open = *labels ? "{" : "", *close = *labels ? "}" : "";
+    fprintf(out, "%s_sum%s%s%s %g\n", name, open, labels, close, counter_get(&hist->sum) * scale);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, open, labels, close,
+            (unsigned long long)counter_get(&hist->total));
+}
+
+void write_metrics(FILE *out) {
+    Metrics *m = calloc(1, sizeof(Metrics));
+    if (!m) {
+        perror("calloc() metrics");
+        return;
+    }
+    metrics_collect(m);
+
+    pthread_mutex_lock(&state_lock);
+    int clients = client_manager.count;
+    int channels = channel_manager.count;
+    size_t history = history_memory;
+    int linked = link_count;
+    int remote = ghost_count;
+    pthread_mutex_unlock(&state_lock);
+
+    fprintf(out, "# HELP chat_clients Connected clients.\n# TYPE chat_clients gauge\n"
+                 "chat_clients %d\n", clients);
+    fprintf(out, "# HELP chat_channels Existing channels.\n# TYPE chat_channels gauge\n"
+                 "chat_channels %d\n", channels);
+    fprintf(out, "# HELP chat_history_bytes Memory held by channel histories.\n"
+                 "# TYPE chat_history_bytes gauge\nchat_history_bytes %zu\n", history);
+    fprintf(out, "# HELP chat_links Established links to other servers.\n# TYPE chat_links gauge\n"
+                 "chat_links %d\n", linked);
+    fprintf(out, "# HELP chat_remote_users Users connected to linked servers.\n"
+                 "# TYPE chat_remote_users gauge\nchat_remote_users %d\n", remote);
+    write_counter_by_type(out, "chat_messages_received_total", "Frames received from clients.", m->msgs_in);
+    write_counter_by_type(out, "chat_messages_sent_total", "Frames queued for clients.", m->msgs_out);
+    fprintf(out, "# HELP chat_bytes_received_total Bytes read from client sockets.\n"
+                 "# TYPE chat_bytes_received_total counter\nchat_bytes_received_total %llu\n",
+            (unsigned long long)counter_get(&m->bytes_in));
+    fprintf(out, "# HELP chat_bytes_sent_total Bytes written to client sockets.\n"
+                 "# TYPE chat_bytes_sent_total counter\nchat_bytes_sent_total %llu\n",
+            (unsigned long long)counter_get(&m->bytes_out));
+
+    if (relay_port) {
+        fprintf(out, "# HELP chat_relay_transfers_total File transfers relayed by the server.\n"
+                     "# TYPE chat_relay_transfers_total counter\nchat_relay_transfers_total %llu\n",
+                (unsigned long long)counter_get(&relay_transfers));
+        fprintf(out, "# HELP chat_relay_bytes_total Bytes forwarded by the file relay.\n"
+                     "# TYPE chat_relay_bytes_total counter\nchat_relay_bytes_total %llu\n",
+                (unsigned long long)counter_get(&relay_bytes));
+    }
+
+    if (msglog_dir) {
+        fprintf(out, "# HELP chat_msglog_records_total Messages written to the persistent log.\n"
+                     "# TYPE chat_msglog_records_total counter\nchat_msglog_records_total %llu\n",
+                (unsigned long long)counter_get(&m->log_records));
+        fprintf(out, "# HELP chat_msglog_commits_total Group commits (fdatasync) of the persistent log.\n"
+                     "# TYPE chat_msglog_commits_total counter\nchat_msglog_commits_total %llu\n",
+                (unsigned long long)counter_get(&m->log_commits));
+    }
+
+    fprintf(out, "# HELP chat_socket_writes_total Write calls on client sockets.\n"
+                 "# TYPE chat_socket_writes_total counter\nchat_socket_writes_total %llu\n",
+            (unsigned long long)counter_get(&m->socket_writes));
+    fprintf(out, "# HELP chat_backpressure_actions_total Actions taken on full client output queues.\n"
+                 "# TYPE chat_backpressure_actions_total counter\n"
+                 "chat_backpressure_actions_total{action=\"drop\"} %llu\n"
+                 "chat_backpressure_actions_total{action=\"coalesce\"} %llu\n"
+                 "chat_backpressure_actions_total{action=\"disconnect\"} %llu\n",
+            (unsigned long long)counter_get(&m->out_dropped),
+            (unsigned long long)counter_get(&m->out_coalesced),
+            (unsigned long long)counter_get(&m->out_disconnects));
+
+    fprintf(out, "# HELP chat_log_dropped_total Log records lost because the ring was full.\n"
+                 "# TYPE chat_log_dropped_total counter\nchat_log_dropped_total %llu\n",
+            (unsigned long long)atomic_load(&log_dropped));
+
+    // Une série par worker : un worker saturé se voit même quand les autres sont au repos
+    fprintf(out, "# HELP chat_loop_iteration_seconds Time spent handling one batch of events.\n"
+                 "# TYPE chat_loop_iteration_seconds summary\n");
+    for (int w = 0; w < worker_count; w++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "worker=\"%d\"", w);
+        write_summary(out, "chat_loop_iteration_seconds", labels, &workers[w].metrics.loop_time, 1e-9);
+    }
+    fprintf(out, "# HELP chat_fanout_recipients Recipients per message sent.\n"
+                 "# TYPE chat_fanout_recipients summary\n");
+    write_summary(out, "chat_fanout_recipients", "", &m->fanout, 1);
+    fprintf(out, "# HELP chat_output_queue_bytes Bytes left in a client output queue after queueing a frame.\n"
+                 "# TYPE chat_output_queue_bytes summary\n");
+    write_summary(out, "chat_output_queue_bytes", "", &m->queue_depth, 1);
+    free(m);
+}
+
+// Un thread à part sert les requêtes HTTP : la collecte ne ralentit pas les workers
+void *metrics_server(void *arg) {
+    int listen_fd = *(int *)arg;
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("accept() metrics");
+            continue;
+        }
+
+        // Un seul thread sert toutes les requêtes : un client muet ou qui ne
+        // lit pas la réponse ne le bloque que METRICS_TIMEOUT secondes
+        struct timeval timeout = { .tv_sec = METRICS_TIMEOUT };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        // La requête est ignorée : toute URL renvoie les mesures
+        char request[STATS_REQUEST_LEN];
+        if (recv(fd, request, sizeof(request), 0) < 0) {
+            perror("recv() metrics");
+            close(fd);
+            continue;
+        }
+
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (out) {
+            write_metrics(out);
+            fclose(out);
+
+            char header[128];
+            int header_len = snprintf(header, sizeof(header),
+                                      "HTTP/1.0 200 OK\r\n"
+                                      "Content-Type: text/plain; version=0.0.4\r\n"
+                                      "Content-Length: %zu\r\n\r\n", body_len);
+            if (send(fd, header, header_len, 0) < 0 || send(fd, body, body_len, 0) < 0) {
+                perror("send() metrics");
+            }
+            free(body);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+// L'export n'écoute que sur l'interface locale
+int start_metrics_server(const char *port) {
+    static int listen_fd;
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        perror("socket() metrics");
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1) {
+        perror("bind() metrics");
+        close(listen_fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_server, &listen_fd) != 0) {
+        perror("pthread_create() metrics");
+        close(listen_fd);
+        return -1;
+    }
+    pthread_detach(thread);
+    log_info("Metrics available on http://127.0.0.1:%s/metrics", port);
+    return 0;
+}
+
+// Relais de fichiers : quand le destinataire ne peut pas recevoir de
+// connexion, les deux pairs se connectent au port du relais avec le jeton
+// fourni dans FILE_ACCEPT et le serveur passe les octets d'une socket à
+// l'autre avec splice(), à travers un tube par sens, sans copie en espace
+// utilisateur. Un thread à part s'en charge : les transferts ne
+// ralentissent pas le chat. Le même thread reçoit et sert les fichiers de
+// salon.
+RelaySession *relay_find_session(const char *token) {
+    for (int i = 0; i < RELAY_MAX_SESSIONS; i++) {
+        if (relay_sessions[i].token[0] != '\0' && strcmp(relay_sessions[i].token, token) == 0) {
+            return &relay_sessions[i];
+        }
+    }
+    return NULL;
+}
+
+void relay_unlink(RelayConn **list, RelayConn *conn) {
+    for (RelayConn **link = list; *link; link = &(*link)->next) {
+        if (*link == conn) {
+            *link = conn->next;
+            return;
+        }
+    }
+}
+
+void spool_release(RelayLoop *loop, RelayConn *conn);
+
+void relay_close(RelayLoop *loop, RelayConn *conn) {
+    if (conn->file) {
+        spool_release(loop, conn);
+    } else if (conn->peer) {
+        conn->peer->peer = NULL;
+    } else {
+        relay_unlink(&loop->unpaired, conn);
+    }
+    if (conn->session) {
+        pthread_mutex_lock(&relay_lock);
+        conn->session->token[0] = '\0';
+        conn->session->waiting = NULL;
+        pthread_mutex_unlock(&relay_lock);
+    }
+    close(conn->fd);
+    if (conn->pipefd[0] >= 0) close(conn->pipefd[0]);
+    if (conn->pipefd[1] >= 0) close(conn->pipefd[1]);
+
+    // D'autres événements du même lot peuvent encore la désigner
+    conn->closed = 1;
+    conn->next = loop->closed;
+    loop->closed = conn;
+}
+
+void relay_close_pair(RelayLoop *loop, RelayConn *conn) {
+    if (conn->peer) relay_close(loop, conn->peer);
+    relay_close(loop, conn);
+}
+
+int relay_open_pipe(RelayConn *conn) {
+    if (pipe2(conn->pipefd, O_NONBLOCK) == -1) {
+        perror("pipe2() relay");
+        return -1;
+    }
+    fcntl(conn->pipefd[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);  // Taille indicative
+    int size = fcntl(conn->pipefd[1], F_GETPIPE_SZ);
+    conn->pipe_size = size > 0 ? (size_t)size : 65536;
+    return 0;
+}
+
+// Socket -> tube puis tube -> socket du pair, jusqu'à ce que rien n'avance ;
+// retourne -1 si la paire doit être fermée
+int relay_pump(RelayConn *conn) {
+    RelayConn *peer = conn->peer;
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        while (!conn->eof && conn->pending < conn->pipe_size) {
+            ssize_t n = splice(conn->fd, NULL, conn->pipefd[1], NULL, conn->pipe_size - conn->pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0) {
+                conn->eof = 1;
+                break;
+            }
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) break;
+                return -1;
+            }
+            conn->pending += n;
+            progress = 1;
+        }
+        while (conn->pending > 0) {
+            ssize_t n = splice(conn->pipefd[0], NULL, peer->fd, NULL, conn->pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN) break;
+                return -1;
+            }
+            conn->pending -= n;
+            counter_add(&relay_bytes, n);
+            progress = 1;
+        }
+    }
+
+    // Fin de flux transmise une fois le tube vidé
+    if (conn->eof && conn->pending == 0 && !conn->shut) {
+        shutdown(peer->fd, SHUT_WR);
+        conn->shut = 1;
+    }
+    return 0;
+}
+
+// Message de contrôle d'un transfert de fichier de salon
+void relay_ctl(RelayConn *conn, int out, int len) {
+    conn->ctl_out = out;
+    conn->ctl_len = len;
+    conn->ctl_done = 0;
+}
+
+// Retourne 1 si le message est passé, 0 s'il faut attendre, -1 en cas d'erreur
+int relay_ctl_step(RelayConn *conn) {
+    while (conn->ctl_done < conn->ctl_len) {
+        unsigned char *data = conn->ctl + conn->ctl_done;
+        size_t len = conn->ctl_len - conn->ctl_done;
+        ssize_t n = conn->ctl_out ? send(conn->fd, data, len, MSG_NOSIGNAL) : recv(conn->fd, data, len, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->ctl_done += n;
+    }
+    return 1;
+}
+
+// Lâche la référence d'une connexion sur son fichier de salon ; un dépôt
+// interrompu met fin aux lectures, qui ne recevraient jamais la suite
+void spool_release(RelayLoop *loop, RelayConn *conn) {
+    ChannelFile *file = conn->file;
+    if (conn->role == RELAY_DOWNLOAD) {
+        for (RelayConn **link = &file->downloads; *link; link = &(*link)->next_download) {
+            if (*link == conn) {
+                *link = conn->next_download;
+                break;
+            }
+        }
+    }
+    conn->file = NULL;
+
+    pthread_mutex_lock(&relay_lock);
+    file->refs--;
+    int failed = conn->role == RELAY_UPLOAD && file->state == SPOOL_UPLOADING;
+    if (failed) file->state = SPOOL_FAILED;
+    pthread_mutex_unlock(&relay_lock);
+
+    if (failed) {
+        log_warn("Upload of channel file %s from %s interrupted", file->filename, file->sender);
+        while (file->downloads) relay_close(loop, file->downloads);
+    }
+}
+
+// Dépôt refusé : l'émetteur reçoit la raison et FILE_REJECT, comme pour un
+// refus immédiat, par la boîte aux lettres de son worker
+void spool_reject(ChannelFile *file, const char *reason) {
+    log_warn("Channel file %s from %s refused: %s", file->filename, file->sender, reason);
+
+    struct message response = {0};
+    response.type = ECHO_SEND;
+    safe_strcpy(response.nick_sender, "Server", NICK_LEN);
+    safe_strcpy(response.infos, reason, INFOS_LEN);
+    OutBuf *buf = outbuf_encode(file->sender_wire, &response, NULL);
+    if (buf) {
+        mailbox_post_to(file->sender_owner, file->sender_fd, file->sender_id, buf);
+        outbuf_release(buf);
+    }
+
+    response.type = FILE_REJECT;
+    safe_strcpy(response.infos, "#", INFOS_LEN);
+    response.pld_len = strlen(file->filename) + 1;
+    buf = outbuf_encode(file->sender_wire, &response, file->filename);
+    if (buf) {
+        mailbox_post_to(file->sender_owner, file->sender_fd, file->sender_id, buf);
+        outbuf_release(buf);
+    }
+}
+
+// Lecture d'un fichier de salon : HELLO de l'émetteur, RESUME du membre,
+// puis le flux déposé depuis la position correspondante, jusqu'à ce qui
+// est déjà arrivé. Retourne 1 une fois DONE reçu, 0 s'il faut attendre
+// la socket ou le dépôt, -1 en cas d'erreur.
+int spool_download(RelayConn *conn) {
+    ChannelFile *file = conn->file;
+    while (1) {
+        int ret;
+        switch (conn->phase) {
+            case SPOOL_HELLO:
+                if (conn->ctl_len == 0) {
+                    if (!file->announced) return 0;
+                    memcpy(conn->ctl, file->hello, TRANSFER_HELLO_LEN);
+                    relay_ctl(conn, 1, TRANSFER_HELLO_LEN);
+                }
+                if ((ret = relay_ctl_step(conn)) <= 0) return ret;
+                relay_ctl(conn, 0, 8);
+                conn->phase = SPOOL_RESUME;
+                break;
+
+            case SPOOL_RESUME: {
+                if ((ret = relay_ctl_step(conn)) <= 0) return ret;
+                uint64_t offset;
+                memcpy(&offset, conn->ctl, 8);
+                offset = be64toh(offset);
+                // Un offset vérifié tombe toujours en limite de bloc ; chaque
+                // bloc complet occupe 4 octets de plus dans le flux déposé
+                if (offset == (uint64_t)file->size) {
+                    conn->file_off = file->total;
+                } else if (offset < (uint64_t)file->size && offset % file->chunk_size == 0) {
+                    conn->file_off = offset + 4 * (offset / file->chunk_size);
+                } else {
+                    return -1;
+                }
+                conn->phase = SPOOL_DATA;
+                counter_add(&relay_transfers, 1);
+                break;
+            }
+
+            case SPOOL_DATA:
+                while (conn->file_off < file->uploaded) {
+                    ssize_t n = sendfile(conn->fd, file->fd, &conn->file_off, file->uploaded - conn->file_off);
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return errno == EAGAIN ? 0 : -1;
+                    }
+                    if (n == 0) return -1;
+                    counter_add(&relay_bytes, n);
+                }
+                if (conn->file_off < file->total) return 0;
+                relay_ctl(conn, 0, 1);
+                conn->phase = SPOOL_DONE;
+                break;
+
+            case SPOOL_DONE:
+                if ((ret = relay_ctl_step(conn)) <= 0) return ret;
+                return conn->ctl[0] == TRANSFER_DONE ? 1 : -1;
+        }
+    }
+}
+
+// Le dépôt a avancé : chaque lecture en attente repart
+void spool_wake(RelayLoop *loop, ChannelFile *file) {
+    RelayConn *conn = file->downloads;
+    while (conn) {
+        RelayConn *next = conn->next_download;
+        if (spool_download(conn) != 0) relay_close(loop, conn);
+        conn = next;
+    }
+}
+
+// Dépôt d'un fichier de salon : HELLO lu (et gardé), RESUME 0, puis le
+// flux entier socket -> tube -> fichier de dépôt, et DONE à la fin.
+// Retourne 1 une fois DONE envoyé, 0 s'il faut attendre, -1 en cas d'erreur.
+int spool_upload(RelayLoop *loop, RelayConn *conn) {
+    ChannelFile *file = conn->file;
+    while (1) {
+        int ret;
+        switch (conn->phase) {
+            case SPOOL_HELLO: {
+                if ((ret = relay_ctl_step(conn)) <= 0) return ret;
+                uint32_t magic, chunk;
+                uint64_t size;
+                memcpy(&magic, conn->ctl, 4);
+                memcpy(&chunk, conn->ctl + 4, 4);
+                memcpy(&size, conn->ctl + 8, 8);
+                file->chunk_size = be32toh(chunk);
+                file->size = be64toh(size);
+                if (be32toh(magic) != TRANSFER_MAGIC || file->chunk_size < SPOOL_CHUNK_MIN ||
+                    file->chunk_size > SPOOL_CHUNK_MAX || file->size < 0) {
+                    return -1;
+                }
+                if (file->size > spool_file_max) {
+                    spool_reject(file, "File too large for this server");
+                    return -1;
+                }
+                // Taille bornée : le calcul ne peut pas déborder
+                off_t total = file->size + 4 * ((file->size + file->chunk_size - 1) / file->chunk_size);
+                memcpy(file->hello, conn->ctl, TRANSFER_HELLO_LEN);
+                pthread_mutex_lock(&relay_lock);
+                int full = spool_reserved + total > spool_total_max;
+                if (!full) {
+                    spool_reserved += total;
+                    file->total = total;
+                    file->announced = 1;
+                }
+                pthread_mutex_unlock(&relay_lock);
+                if (full) {
+                    spool_reject(file, "Not enough room left on the server for this file");
+                    return -1;
+                }
+
+                // Un dépôt repart toujours de zéro
+                memset(conn->ctl, 0, 8);
+                relay_ctl(conn, 1, 8);
+                conn->phase = SPOOL_RESUME;
+                spool_wake(loop, file);
+                break;
+            }
+
+            case SPOOL_RESUME:
+                if ((ret = relay_ctl_step(conn)) <= 0) return ret;
+                if (relay_open_pipe(conn) == -1) return -1;
+                conn->phase = SPOOL_DATA;
+                break;
+
+            case SPOOL_DATA: {
+                off_t before = file->uploaded;
+                while (file->uploaded < file->total) {
+                    size_t want = file->total - file->uploaded;
+                    if (want > conn->pipe_size) want = conn->pipe_size;
+                    ssize_t n = splice(conn->fd, NULL, conn->pipefd[1], NULL, want,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                    if (n == 0) return -1;
+                    if (n < 0) {
+                        if (errno == EINTR) continue;
+                        if (errno != EAGAIN) return -1;
+                        break;
+                    }
+                    // L'écriture sur disque reste bloquante : le tube est vidé aussitôt
+                    while (n > 0) {
+                        loff_t off = file->uploaded;
+                        ssize_t written = splice(conn->pipefd[0], NULL, file->fd, &off, n, SPLICE_F_MOVE);
+                        if (written < 0) {
+                            if (errno == EINTR) continue;
+                            perror("splice() spool file");
+                            return -1;
+                        }
+                        file->uploaded += written;
+                        n -= written;
+                        counter_add(&relay_bytes, written);
+                    }
+                }
+                if (file->uploaded != before) spool_wake(loop, file);
+                if (file->uploaded < file->total) return 0;
+
+                pthread_mutex_lock(&relay_lock);
+                file->state = SPOOL_READY;
+                file->expires = time(NULL) + RELAY_FILE_TTL;
+                pthread_mutex_unlock(&relay_lock);
+                log_info("Channel file %s from %s stored (%lld bytes)", file->filename, file->sender,
+                         (long long)file->size);
+
+                conn->ctl[0] = TRANSFER_DONE;
+                relay_ctl(conn, 1, 1);
+                conn->phase = SPOOL_DONE;
+                break;
+            }
+
+            case SPOOL_DONE:
+                return relay_ctl_step(conn);
+        }
     }
-    
-    send_message(client->fd, &response, NULL);
 }
 
-void handle_broadcast(Client *sender, struct message *msg, const char *payload) {
-    struct message broadcast = *msg;
-    safe_strcpy(broadcast.nick_sender, sender->nickname, NICK_LEN);
-    
-    for (int i = 0; i < client_manager.count; i++) {
-        if (client_manager.clients[i].fd != sender->fd && 
-            client_manager.clients[i].has_nickname) {
-            send_message(client_manager.clients[i].fd, &broadcast, payload);
+// Lit "<jeton>\n" sans rien consommer au-delà : les premiers octets du
+// transfert restent dans la socket jusqu'à l'appariement
+int relay_read_token(RelayConn *conn) {
+    while (conn->token_len < RELAY_TOKEN_LEN + 1) {
+        ssize_t n = recv(conn->fd, conn->token + conn->token_len, RELAY_TOKEN_LEN + 1 - conn->token_len, 0);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
         }
+        conn->token_len += n;
     }
+    if (conn->token[RELAY_TOKEN_LEN] != '\n') return -1;
+    conn->token[RELAY_TOKEN_LEN] = '\0';
+    return 1;
 }
 
-void handle_unicast(Client *sender, struct message *msg, const char *payload) {
-    if (msg->type == FILE_REQUEST || msg->type == FILE_ACCEPT || 
-        msg->type == FILE_REJECT || msg->type == FILE_ACK) {
-        Client *target = find_client_by_nickname(msg->infos);
-        
-        if (msg->type == FILE_REQUEST && !target) {
-            struct message response = {0};
-            response.type = ECHO_SEND;
-            safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-            snprintf(response.infos, INFOS_LEN, "User %.100s does not exist", msg->infos);
-            send_message(sender->fd, &response, NULL);
-            return;
-        }
+void relay_event(RelayLoop *loop, RelayConn *conn, uint32_t events) {
+    if (conn->role == RELAY_UPLOAD) {
+        if (spool_upload(loop, conn) != 0) relay_close(loop, conn);
+        return;
+    }
+    if (conn->role == RELAY_DOWNLOAD) {
+        if (spool_download(conn) != 0) relay_close(loop, conn);
+        return;
+    }
 
-        if (target) {
-            struct message forward = *msg;
-            if (msg->type == FILE_ACCEPT || msg->type == FILE_REJECT) {
-                safe_strcpy(forward.infos, sender->nickname, NICK_LEN);
-            } else {
-                safe_strcpy(forward.nick_sender, sender->nickname, NICK_LEN);
-            }
-            send_message(target->fd, &forward, payload);
-            return;
+    if (conn->peer) {
+        if (relay_pump(conn) == -1 || relay_pump(conn->peer) == -1 ||
+            (conn->shut && conn->peer->shut)) {
+            relay_close_pair(loop, conn);
         }
         return;
     }
 
-    Client *target = find_client_by_nickname(msg->infos);
-    if (!target) {
-        struct message response = {0};
-        response.type = ECHO_SEND;
-        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-        snprintf(response.infos, INFOS_LEN, "User %.100s does not exist", msg->infos);
-        send_message(sender->fd, &response, NULL);
+    // Connexion qui attend déjà son pair : seule une fermeture est possible
+    if (conn->session) {
+        if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) relay_close(loop, conn);
         return;
     }
 
-    struct message forward = *msg;
-    safe_strcpy(forward.nick_sender, sender->nickname, NICK_LEN);
-    send_message(target->fd, &forward, payload);
-}
-void handle_client_message(int fd, struct message *msg, const char *payload) {
-    Client *client = find_client_by_fd(fd);
-    if (!client) return;
-    
-    if (!client->has_nickname && msg->type != NICKNAME_NEW) {
-        struct message response = {0};
-        response.type = ECHO_SEND;
-        safe_strcpy(response.nick_sender, "Server", NICK_LEN);
-        safe_strcpy(response.infos, "Please set your nickname using /nick <pseudo>", INFOS_LEN);
-        send_message(fd, &response, NULL);
+    int ret = relay_read_token(conn);
+    if (ret == 0) return;
+    if (ret < 0) {
+        relay_close(loop, conn);
         return;
     }
-    
-    switch (msg->type) {
-        case NICKNAME_NEW:
-            handle_nickname_new(client, msg);
-            break;
-            
-        case NICKNAME_LIST:
-            handle_nickname_list(client);
-            break;
-            
-        case NICKNAME_INFOS:
-            handle_nickname_infos(client, msg);
-            break;
-            
-        case BROADCAST_SEND:
-            handle_broadcast(client, msg, payload);
-            break;
-            
-        case UNICAST_SEND:
-            handle_unicast(client, msg, payload);
-            break;
-            
-        case MULTICAST_CREATE:
-            handle_channel_create(client, msg->infos);
-            break;
-            
-        case MULTICAST_LIST:
-            handle_channel_list(client);
-            break;
-            
-        case MULTICAST_JOIN:
-            handle_channel_join(client, msg->infos);
-            break;
-            
-        case MULTICAST_QUIT:
-            handle_channel_quit(client, msg->infos);
-            break;
-            
-        case MULTICAST_SEND:
-        case ECHO_SEND:
-            handle_channel_message(client, payload);
-            break;
-        case FILE_REQUEST:
-        case FILE_ACCEPT:
-        case FILE_REJECT:
-        case FILE_ACK:
-            handle_unicast(client, msg, payload);
-            break;
-            
-        default:
-            printf("Unknown message type: %s\n", msg_type_str[msg->type]);
-            break;
+
+    pthread_mutex_lock(&relay_lock);
+    RelaySession *session = relay_find_session(conn->token);
+    RelayConn *peer = NULL;
+    if (session && session->file) {
+        // Fichier de salon : la référence de la session passe à la connexion
+        conn->file = session->file;
+        conn->role = session->upload ? RELAY_UPLOAD : RELAY_DOWNLOAD;
+        session->token[0] = '\0';
+        session->file = NULL;
+    } else if (session && session->waiting) {
+        // Le jeton ne sert qu'une fois
+        peer = session->waiting;
+        session->token[0] = '\0';
+        session->waiting = NULL;
+        peer->session = NULL;
+    } else if (session) {
+        session->waiting = conn;
+        conn->session = session;
     }
-}
+    pthread_mutex_unlock(&relay_lock);
 
-void remove_client(int fd) {
-    for (int i = 0; i < client_manager.count; i++) {
-        if (client_manager.clients[i].fd == fd) {
-            remove_from_current_channel(&client_manager.clients[i]);
-            
-            printf("Client %s disconnected\n", 
-                   client_manager.clients[i].has_nickname ? 
-                   client_manager.clients[i].nickname : "unknown");
-            
-            close(fd);
-            
-            client_manager.count--;
-            if (i < client_manager.count) {
-                client_manager.clients[i] = client_manager.clients[client_manager.count];
-            }
-            return;
+    if (!session) {
+        log_warn("Relay connection with an unknown token, closed");
+        relay_close(loop, conn);
+        return;
+    }
+    if (conn->file) {
+        relay_unlink(&loop->unpaired, conn);
+        conn->phase = SPOOL_HELLO;
+        if (conn->role == RELAY_UPLOAD) {
+            relay_ctl(conn, 0, TRANSFER_HELLO_LEN);
+        } else {
+            conn->next_download = conn->file->downloads;
+            conn->file->downloads = conn;
         }
+        relay_event(loop, conn, events);
+        return;
     }
-}
+    if (!peer) return;
 
-void add_client(int fd, struct sockaddr_in addr) {
-    if (client_manager.count >= MAX_CLIENTS) {
-        fprintf(stderr, "Maximum clients reached\n");
-        close(fd);
+    relay_unlink(&loop->unpaired, conn);
+    relay_unlink(&loop->unpaired, peer);
+    conn->peer = peer;
+    peer->peer = conn;
+    if (relay_open_pipe(conn) == -1 || relay_open_pipe(peer) == -1) {
+        relay_close_pair(loop, conn);
         return;
     }
-    
-    Client *client = &client_manager.clients[client_manager.count++];
-    client->fd = fd;
-    client->addr = addr;
-    client->connection_time = time(NULL);
-    client->has_nickname = 0;
-    client->nickname[0] = '\0';
-    client->current_channel[0] = '\0';
-    
-    char ip_str[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(addr.sin_addr), ip_str, INET_ADDRSTRLEN);
-    printf("New client connected from %s:%d\n", ip_str, ntohs(addr.sin_port));
-    
-    struct message welcome = {0};
-    welcome.type = ECHO_SEND;
-    safe_strcpy(welcome.nick_sender, "Server", NICK_LEN);
-    safe_strcpy(welcome.infos, "Please login with /nick <your pseudo>", INFOS_LEN);
-    send_message(fd, &welcome, NULL);
-}
+    counter_add(&relay_transfers, 1);
+    log_debug("Relayed transfer %s started", conn->token);
 
-void echo_server(int listen_fd) {
-    struct pollfd fds[MAX_CLIENTS + 1];
-    int nfds = 1;
+    // Des octets ont pu arriver avant l'appariement : pas de nouveau front
+    if (relay_pump(conn) == -1 || relay_pump(peer) == -1) {
+        relay_close_pair(loop, conn);
+    }
+}
 
-    fds[0].fd = listen_fd;
-    fds[0].events = POLLIN;
+// Ferme les connexions restées sans pair et libère les sessions périmées
+void relay_sweep(RelayLoop *loop) {
+    time_t now = time(NULL);
+    RelayConn *conn = loop->unpaired;
+    while (conn) {
+        RelayConn *next = conn->next;
+        if (conn->deadline < now) relay_close(loop, conn);
+        conn = next;
+    }
 
-    printf("Server is ready for connections...\n");
+    pthread_mutex_lock(&relay_lock);
+    for (int i = 0; i < RELAY_MAX_SESSIONS; i++) {
+        RelaySession *session = &relay_sessions[i];
+        if (session->token[0] != '\0' && !session->waiting && session->deadline < now) {
+            session->token[0] = '\0';
+            if (session->file) {
+                // Émetteur jamais connecté : le fichier ne sera pas déposé
+                session->file->refs--;
+                if (session->upload) session->file->state = SPOOL_FAILED;
+                session->file = NULL;
+            }
+        }
+    }
 
-    while (1) {
-        for (int i = 0; i < client_manager.count; i++) {
-            fds[i + 1].fd = client_manager.clients[i].fd;
-            fds[i + 1].events = POLLIN;
+    // Fichiers de salon expirés ou ratés, une fois plus personne dessus
+    ChannelFile **link = &channel_files;
+    while (*link) {
+        ChannelFile *file = *link;
+        if (file->refs == 0 && (file->state == SPOOL_FAILED || file->expires < now)) {
+            *link = file->next;
+            if (file->announced) spool_reserved -= file->total;
+            close(file->fd);
+            free(file->offered);
+            free(file);
+        } else {
+            link = &file->next;
         }
-        nfds = client_manager.count + 1;
+    }
+    pthread_mutex_unlock(&relay_lock);
+}
 
-        int poll_count = poll(fds, nfds, POLL_TIMEOUT);
-        if (poll_count < 0) {
-            perror("poll()");
+void *relay_server(void *arg) {
+    int listen_fd = *(int *)arg;
+    int epfd = epoll_create1(0);
+    if (epfd == -1) {
+        perror("epoll_create1() relay");
+        return NULL;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    RelayLoop loop = { NULL, NULL };
+    struct epoll_event events[RELAY_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, RELAY_EVENTS, 1000);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait() relay");
             break;
         }
-        if (fds[0].revents & POLLIN) {
-            struct sockaddr_in client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            int new_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
-            if (new_fd < 0) {
-                perror("accept()");
+
+        for (int i = 0; i < n; i++) {
+            RelayConn *conn = events[i].data.ptr;
+            if (conn) {
+                if (!conn->closed) relay_event(&loop, conn, events[i].events);
                 continue;
             }
-            
-            add_client(new_fd, client_addr);
-        }
-
-        for (int i = 1; i < nfds; i++) {
-            if (fds[i].revents & POLLIN) {
-                struct message msg = {0};
-                ssize_t rec = recv(fds[i].fd, &msg, sizeof(struct message), 0);
-                
-                if (rec <= 0) {
-                    if (rec == 0) printf("Client disconnected\n");
-                    else perror("recv() message struct");
-                    remove_client(fds[i].fd);
+
+            int fd;
+            while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                conn = calloc(1, sizeof(RelayConn));
+                if (!conn) {
+                    perror("calloc() relay");
+                    close(fd);
                     continue;
                 }
-                
-                char payload[MSG_LEN] = {0};
-                if (msg.pld_len > 0) {
-                    if (recv(fds[i].fd, payload, msg.pld_len, 0) <= 0) {
-                        perror("recv() payload");
-                        remove_client(fds[i].fd);
-                        continue;
-                    }
-                    payload[msg.pld_len] = '\0';
+                conn->fd = fd;
+                conn->pipefd[0] = conn->pipefd[1] = -1;
+                conn->deadline = time(NULL) + RELAY_TIMEOUT;
+                conn->next = loop.unpaired;
+                loop.unpaired = conn;
+
+                // Déclenchement sur front : relay_pump() avance jusqu'à EAGAIN
+                struct epoll_event conn_ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                               .data.ptr = conn };
+                if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &conn_ev) == -1) {
+                    perror("epoll_ctl() relay");
+                    relay_close(&loop, conn);
                 }
-                
-                handle_client_message(fds[i].fd, &msg, payload);
             }
         }
-    }
+        relay_sweep(&loop);
 
-    // Nettoyage
-    for (int i = 0; i < client_manager.count; i++) {
-        close(client_manager.clients[i].fd);
+        while (loop.closed) {
+            RelayConn *conn = loop.closed;
+            loop.closed = conn->next;
+            free(conn);
+        }
     }
+    close(epfd);
+    return NULL;
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(EXIT_FAILURE);
+// Le relais écoute sur toutes les interfaces, comme le chat : il sert
+// justement les pairs qui ne peuvent pas se joindre directement
+int start_relay_server(const char *port) {
+    static int listen_fd;
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd == -1) {
+        perror("socket() relay");
+        return -1;
+    }
+
+    int yes = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1) {
+        perror("bind() relay");
+        close(listen_fd);
+        return -1;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, relay_server, &listen_fd) != 0) {
+        perror("pthread_create() relay");
+        close(listen_fd);
+        return -1;
     }
+    pthread_detach(thread);
+    log_info("File relay listening on port %s", port);
+    return 0;
+}
 
+// Chaque worker a sa propre socket d'écoute ; SO_REUSEPORT laisse le noyau
+// répartir les connexions entre elles
+int create_listener(const char *port) {
     int sfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sfd == -1) {
         perror("socket()");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     int yes = 1;
-    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
         perror("setsockopt()");
-        exit(EXIT_FAILURE);
+        close(sfd);
+        return -1;
     }
 
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(atoi(argv[1]));
+    server_addr.sin_port = htons(atoi(port));
     server_addr.sin_addr.s_addr = INADDR_ANY;
 
     if (bind(sfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("bind()");
-        exit(EXIT_FAILURE);
+        close(sfd);
+        return -1;
     }
 
     if ((listen(sfd, SOMAXCONN)) != 0) {
         perror("listen()");
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+
+// Un descripteur par connexion : la limite souple est portée à la limite dure
+void raise_fd_limit(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit()");
+        return;
+    }
+    if (limit.rlim_cur == limit.rlim_max) return;
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("setrlimit()");
+    }
+}
+
+// Liaisons sortantes
+// Reçoit une socket connectée par le thread des liaisons (worker
+// propriétaire, sous state_lock) et se présente
+void link_adopt(int fd, LinkPeer *peer) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    getpeername(fd, (struct sockaddr *)&addr, &addr_len);
+
+    Client *client = client_register(fd, addr);
+    if (!client) {
+        atomic_store(&peer->linked, 0);
+        return;
+    }
+    client->peer = peer;
+    log_info("Connected to server %s:%s", peer->host, peer->port);
+    link_send_hello(client);
+}
+
+int link_connect(LinkPeer *peer) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(peer->host, peer->port, &hints, &res);
+    if (err != 0) {
+        log_warn("Server %s:%s: %s", peer->host, peer->port, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) continue;
+        // Un serveur injoignable ne bloque pas les autres trop longtemps
+        struct timeval timeout = { .tv_sec = LINK_RETRY };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        timeout.tv_sec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Tente toutes les LINK_RETRY secondes les serveurs non liés ; la socket
+// est confiée à un worker par sa boîte aux lettres
+void *link_connector(void *arg) {
+    (void)arg;
+    int next_worker = 0;
+    while (1) {
+        for (int i = 0; i < link_peer_count; i++) {
+            LinkPeer *peer = &link_peers[i];
+            if (atomic_load(&peer->linked)) continue;
+            int fd = link_connect(peer);
+            if (fd == -1) {
+                log_debug("Server %s:%s unreachable, retrying", peer->host, peer->port);
+                continue;
+            }
+            atomic_store(&peer->linked, 1);
+            mailbox_post_link(&workers[next_worker], fd, peer);
+            next_worker = (next_worker + 1) % worker_count;
+        }
+        sleep(LINK_RETRY);
+    }
+    return NULL;
+}
+
+int start_link_connector(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, link_connector, NULL) != 0) {
+        perror("pthread_create() links");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b poll|epoll|io_uring] [-w workers] [-m metrics_port] [-r relay_port] [-H history_kb] [-l log_dir]\n"
+                    "       [-s file_mb[:total_mb]] [-q limit_kb[:frames]] [-p drop|coalesce|disconnect] [-c] [-v]\n"
+                    "       [-N node_name] [-K link_key] [-L host:port]... <port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:w:m:r:H:l:s:q:p:cvN:K:L:")) != -1) {
+        switch (opt) {
+            case 'b':
+                if (strcmp(optarg, "poll") == 0) {
+                    loop_backend = BACKEND_POLL;
+                } else if (strcmp(optarg, "epoll") == 0) {
+                    loop_backend = BACKEND_EPOLL;
+                } else if (strcmp(optarg, "io_uring") == 0) {
+#ifdef WITH_IO_URING
+                    loop_backend = BACKEND_URING;
+#else
+                    fprintf(stderr, "io_uring support not compiled in (build with -DWITH_IO_URING)\n");
+                    exit(EXIT_FAILURE);
+#endif
+                } else {
+                    fprintf(stderr, "Unknown backend: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                worker_count = atoi(optarg);
+                if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                    fprintf(stderr, "Workers must be between 1 and %d\n", MAX_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                metrics_port = optarg;
+                break;
+            case 'r':
+                relay_port = optarg;
+                break;
+            case 'H':
+                history_limit = (size_t)atol(optarg) * 1024;  // 0 : pas d'historique
+                break;
+            case 'l':
+                msglog_dir = optarg;
+                break;
+            case 's': {
+                // fichier_mo[:total_mo]
+                char *total = strchr(optarg, ':');
+                spool_file_max = (off_t)atol(optarg) << 20;
+                if (total) spool_total_max = (off_t)atol(total + 1) << 20;
+                if (spool_file_max <= 0 || spool_total_max <= 0) {
+                    fprintf(stderr, "Invalid spool limit: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'q': {
+                // limite_ko[:trames]
+                char *frames = strchr(optarg, ':');
+                out_limit_bytes = (size_t)atol(optarg) * 1024;
+                if (frames) out_limit_frames = atoi(frames + 1);
+                if (out_limit_bytes == 0 || out_limit_frames <= 0) {
+                    fprintf(stderr, "Invalid output limit: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'p':
+                if (strcmp(optarg, "drop") == 0) {
+                    out_policy = OUT_POLICY_DROP;
+                } else if (strcmp(optarg, "coalesce") == 0) {
+                    out_policy = OUT_POLICY_COALESCE;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    out_policy = OUT_POLICY_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Unknown output policy: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                cork_output = 1;
+                break;
+            case 'v':
+                log_level = LOG_DEBUG;
+                break;
+            case 'N':
+                if (!is_nickname_valid(optarg)) {
+                    fprintf(stderr, "Invalid server name: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                safe_strcpy(node_name, optarg, NICK_LEN);
+                break;
+            case 'K':
+                link_key = optarg;
+                break;
+            case 'L': {
+                // hôte:port
+                char *colon = strrchr(optarg, ':');
+                if (!colon || link_peer_count == MAX_LINKS) {
+                    fprintf(stderr, "Invalid link (host:port, %d at most): %s\n", MAX_LINKS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                LinkPeer *peer = &link_peers[link_peer_count++];
+                snprintf(peer->host, sizeof(peer->host), "%.*s", (int)(colon - optarg), optarg);
+                snprintf(peer->port, sizeof(peer->port), "%s", colon + 1);
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
+    if (log_start(stdout) == -1) exit(EXIT_FAILURE);
+    const char *port = argv[optind];
+
+    // Le repli poll() reconstruit son tableau depuis l'état global : un seul worker
+    if (loop_backend == BACKEND_POLL && worker_count > 1) {
+        fprintf(stderr, "The poll backend only supports a single worker\n");
+        exit(EXIT_FAILURE);
+    }
+    if (link_peer_count > 0 && !link_key) {
+        fprintf(stderr, "Outgoing links need a link key (-K)\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!node_name[0]) snprintf(node_name, NICK_LEN, "node%s", port);
+
+    if (msglog_dir && start_msglog() == -1) exit(EXIT_FAILURE);
+
+    for (int i = 0; i < worker_count; i++) {
+        workers[i].id = i;
+        workers[i].listen_fd = create_listener(port);
+        if (workers[i].listen_fd == -1 || worker_init(&workers[i]) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    log_info("Server listening on port %s with %d worker(s)...", port, worker_count);
+    if (metrics_port && start_metrics_server(metrics_port) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (relay_port && start_relay_server(relay_port) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    if (link_key) log_info("Federation enabled as server %s", node_name);
+    if (link_peer_count > 0 && start_link_connector() == -1) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Server listening on port %s...\n", argv[1]);
-    echo_server(sfd);
-    close(sfd);
+    for (int i = 1; i < worker_count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, echo_server, &workers[i]) != 0) {
+            perror("pthread_create()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    echo_server(&workers[0]);
+
+    for (int i = 1; i < worker_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Nettoyage
+    for (int i = 0; i < client_manager.count; i++) {
+        close(client_manager.clients[i]->fd);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        close(workers[i].listen_fd);
+        close(workers[i].wake_fd);
+        if (loop_backend == BACKEND_EPOLL) close(workers[i].epfd);
+#ifdef WITH_IO_URING
+        if (loop_backend == BACKEND_URING) close(workers[i].ring.fd);
+#endif
+    }
     return EXIT_SUCCESS;
 }
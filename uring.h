@@ -0,0 +1,238 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Accès minimal à io_uring par les appels système bruts (sans liburing).
+ *
+ * Une file de soumission (SQ) et une file de complétion (CQ) partagées
+ * avec le noyau : les SQE préparées ne coûtent rien tant qu'elles ne sont
+ * pas publiées, et un seul io_uring_enter() les soumet toutes en attendant
+ * les complétions suivantes.
+ *
+ * Les réceptions multishot piochent dans un anneau de tampons fournis
+ * (UringBufRing) ; chaque tampon doit être rendu avec uring_buf_recycle()
+ * une fois ses données consommées.
+ */
+
+typedef struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_pending;  // SQE préparées mais pas encore soumises
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+} Uring;
+
+typedef struct {
+    struct io_uring_buf_ring *ring;
+    unsigned char *base;  // entries tampons de size octets, contigus
+    unsigned entries;     // Puissance de 2
+    unsigned size;
+    uint16_t bgid;
+} UringBufRing;
+
+static inline int uring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// flags : IORING_SETUP_*. cq_entries à 0 laisse le noyau choisir (2 x entries).
+static inline int uring_init(Uring *ring, unsigned entries, unsigned cq_entries, unsigned flags) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    if (cq_entries) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0) return -1;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+    }
+
+    unsigned char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) goto fail;
+    unsigned char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) goto fail;
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Table d'indirection fixe : la case i de la SQ désigne la SQE i
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+    return 0;
+
+fail:
+    close(ring->fd);
+    return -1;
+}
+
+// Soumet les SQE en attente et attend au moins wait_nr complétions
+static inline int uring_submit_and_wait(Uring *ring, unsigned wait_nr) {
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = uring_enter(ring->fd, ring->sq_pending, wait_nr, flags);
+    if (ret < 0) return -1;
+    ring->sq_pending -= (unsigned)ret < ring->sq_pending ? (unsigned)ret : ring->sq_pending;
+    return ret;
+}
+
+// SQE libre, remise à zéro ; NULL seulement si la file reste pleine après une soumission
+static inline struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries) {
+        if (uring_submit_and_wait(ring, 0) < 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    // Publiée tout de suite : le prochain io_uring_enter() la verra
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+    return sqe;
+}
+
+static inline struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t bgid,
+                                             uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_poll_multishot(struct io_uring_sqe *sqe, int fd, unsigned events,
+                                             uint64_t user_data) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg,
+                                      unsigned flags, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+}
+
+static inline void uring_buf_add(UringBufRing *br, unsigned bid, unsigned offset) {
+    uint16_t tail = br->ring->tail;
+    struct io_uring_buf *buf = &br->ring->bufs[(tail + offset) & (br->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(br->base + (size_t)bid * br->size);
+    buf->len = br->size;
+    buf->bid = (uint16_t)bid;
+}
+
+static inline void uring_buf_advance(UringBufRing *br, unsigned count) {
+    __atomic_store_n(&br->ring->tail, (uint16_t)(br->ring->tail + count), __ATOMIC_RELEASE);
+}
+
+// Rend un tampon à l'anneau après usage
+static inline void uring_buf_recycle(UringBufRing *br, unsigned bid) {
+    uring_buf_add(br, bid, 0);
+    uring_buf_advance(br, 1);
+}
+
+static inline unsigned char *uring_buf_data(UringBufRing *br, unsigned bid) {
+    return br->base + (size_t)bid * br->size;
+}
+
+// Crée et enregistre un anneau de entries tampons de size octets (groupe bgid)
+static inline int uring_buf_ring_init(Uring *ring, UringBufRing *br, unsigned entries,
+                                      unsigned size, uint16_t bgid) {
+    memset(br, 0, sizeof(*br));
+    br->entries = entries;
+    br->size = size;
+    br->bgid = bgid;
+
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+    br->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->ring == MAP_FAILED) return -1;
+    br->base = malloc((size_t)entries * size);
+    if (!br->base) {
+        munmap(br->ring, ring_size);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)br->ring;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(br->base);
+        munmap(br->ring, ring_size);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < entries; i++) uring_buf_add(br, i, i);
+    uring_buf_advance(br, entries);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,270 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "msg_struct.h"
+#include "common.h"
+
+/*
+ * Formats de trame.
+ *
+ * WIRE_LEGACY : struct message brute (264 octets) suivie du payload.
+ * WIRE_V2     : trame compacte, négociée par PROTO_HELLO à la connexion :
+ *
+ *     varint  longueur du corps (tout ce qui suit)
+ *     u8      type
+ *     varint  longueur du pseudo, puis le pseudo (sans '\0')
+ *     varint  longueur de infos, puis infos (sans '\0')
+ *     payload (le reste du corps)
+ *
+ * Les varints sont en base 128, octets de poids faible en premier.
+ *
+ * WIRE_DEFLATE : trame WIRE_V2 dont le payload peut être compressé (deflate
+ * brut, dictionnaire wire_dictionary), signalé par WIRE_COMPRESSED dans
+ * l'octet de type. Chaque trame est compressée seule : une trame diffusée
+ * est compressée une fois et partagée par tous ses destinataires.
+ */
+#define WIRE_LEGACY 1
+#define WIRE_V2 2
+#define WIRE_DEFLATE 3
+#define WIRE_VERSION WIRE_DEFLATE
+
+#define WIRE_COMPRESSED 0x80    // Bit de l'octet de type
+#define WIRE_DEFLATE_MIN 128    // Payloads plus courts envoyés tels quels
+#define WIRE_DEFLATE_LEVEL 6
+#define WIRE_DEFLATE_WINDOW 12  // 4 Ko : le payload et la fin du dictionnaire
+
+#define WIRE_VARINT_MAX 5
+#define WIRE_MAX_HEADER (WIRE_VARINT_MAX + 1 + WIRE_VARINT_MAX + NICK_LEN + WIRE_VARINT_MAX + INFOS_LEN)
+#define WIRE_MAX_FRAME (WIRE_MAX_HEADER + MSG_LEN)
+#define WIRE_BUF_SIZE 16384
+
+// Tampon de réception d'une connexion : une seule lecture par événement,
+// les trames complètes sont extraites sur place et la trame partielle
+// éventuelle reste pour la lecture suivante
+typedef struct {
+    unsigned char data[WIRE_BUF_SIZE];
+    size_t start;
+    size_t end;
+} WireBuffer;
+
+static inline size_t wire_put_varint(unsigned char *out, uint32_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (unsigned char)value;
+    return n;
+}
+
+// Retourne le nombre d'octets lus, 0 si le varint est incomplet, -1 s'il est invalide
+static inline int wire_get_varint(const unsigned char *in, size_t len, uint32_t *value) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < len && i < WIRE_VARINT_MAX; i++) {
+        result |= (uint32_t)(in[i] & 0x7f) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *value = result;
+            return (int)i + 1;
+        }
+    }
+    return len >= WIRE_VARINT_MAX ? -1 : 0;
+}
+
+// Dictionnaire préchargé des deux côtés : les trames sont trop courtes pour
+// que deflate y trouve seul des répétitions. Les chaînes les plus fréquentes
+// sont à la fin, là où les références sont les plus courtes.
+static const char wire_dictionary[] =
+    "the and you that this with have for not are but what was will can just "
+    "http://https://www. .com .org .png .jpg .pdf "
+    "INFO> You were the last user in this channel, has been destroyed "
+    "You have created channel Channel already exists You are not in any channel "
+    "relay: sends the file named  has received  connected since  with IP  port "
+    "INFO>  has quit  has joined INFO> You have joined  users)\n- ";
+
+// Compresse un payload dans out (len octets au moins) ; retourne la taille
+// compressée, ou 0 si la compression ne fait rien gagner
+static inline size_t wire_deflate(const char *in, size_t len, unsigned char *out) {
+    static __thread z_stream stream;
+    static __thread int ready;
+    if (!ready) {
+        if (deflateInit2(&stream, WIRE_DEFLATE_LEVEL, Z_DEFLATED, -WIRE_DEFLATE_WINDOW,
+                         8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+        ready = 1;
+    } else if (deflateReset(&stream) != Z_OK) {
+        return 0;
+    }
+    if (deflateSetDictionary(&stream, (const Bytef *)wire_dictionary,
+                             sizeof(wire_dictionary) - 1) != Z_OK) {
+        return 0;
+    }
+
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = (uInt)len;
+    stream.next_out = out;
+    stream.avail_out = (uInt)len - 1;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) return 0;
+    return len - 1 - stream.avail_out;
+}
+
+// Décompresse dans out (cap octets) ; retourne la taille obtenue ou -1
+static inline int wire_inflate(const unsigned char *in, size_t len, char *out, size_t cap) {
+    static __thread z_stream stream;
+    static __thread int ready;
+    if (!ready) {
+        if (inflateInit2(&stream, -15) != Z_OK) return -1;
+        ready = 1;
+    } else if (inflateReset(&stream) != Z_OK) {
+        return -1;
+    }
+    if (inflateSetDictionary(&stream, (const Bytef *)wire_dictionary,
+                             sizeof(wire_dictionary) - 1) != Z_OK) {
+        return -1;
+    }
+
+    stream.next_in = (Bytef *)in;
+    stream.avail_in = (uInt)len;
+    stream.next_out = (Bytef *)out;
+    stream.avail_out = (uInt)cap;
+    if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_in != 0) return -1;
+    return (int)(cap - stream.avail_out);
+}
+
+// Taille maximale d'une trame encodée, pour dimensionner le tampon de sortie
+static inline size_t wire_frame_bound(int version, size_t pld_len) {
+    if (version == WIRE_LEGACY) return sizeof(struct message) + pld_len;
+    return WIRE_MAX_HEADER + pld_len;
+}
+
+// Encode msg et son payload dans out ; retourne la taille de la trame
+static inline size_t wire_encode(int version, const struct message *msg,
+                                 const char *payload, unsigned char *out) {
+    size_t pld_len = (msg->pld_len > 0 && payload != NULL) ? (size_t)msg->pld_len : 0;
+
+    if (version == WIRE_LEGACY) {
+        struct message header = *msg;
+        header.pld_len = (int)pld_len;
+        memcpy(out, &header, sizeof(struct message));
+        if (pld_len > 0) memcpy(out + sizeof(struct message), payload, pld_len);
+        return sizeof(struct message) + pld_len;
+    }
+
+    size_t nick_len = strnlen(msg->nick_sender, NICK_LEN);
+    size_t infos_len = strnlen(msg->infos, INFOS_LEN);
+
+    unsigned char type = (unsigned char)msg->type;
+    unsigned char packed[MSG_LEN];
+    if (version == WIRE_DEFLATE && pld_len >= WIRE_DEFLATE_MIN && pld_len <= MSG_LEN) {
+        size_t packed_len = wire_deflate(payload, pld_len, packed);
+        if (packed_len > 0) {
+            type |= WIRE_COMPRESSED;
+            payload = (const char *)packed;
+            pld_len = packed_len;
+        }
+    }
+
+    unsigned char header[WIRE_MAX_HEADER];
+    size_t n = 0;
+    header[n++] = type;
+    n += wire_put_varint(header + n, (uint32_t)nick_len);
+    memcpy(header + n, msg->nick_sender, nick_len);
+    n += nick_len;
+    n += wire_put_varint(header + n, (uint32_t)infos_len);
+    memcpy(header + n, msg->infos, infos_len);
+    n += infos_len;
+
+    size_t prefix = wire_put_varint(out, (uint32_t)(n + pld_len));
+    memcpy(out + prefix, header, n);
+    if (pld_len > 0) memcpy(out + prefix + n, payload, pld_len);
+    return prefix + n + pld_len;
+}
+
+// Décode le corps d'une trame WIRE_V2 ou WIRE_DEFLATE (sans le préfixe de longueur).
+// payload doit pouvoir contenir MSG_LEN octets ; il est terminé par '\0'.
+// Un payload compressé n'est accepté que si WIRE_DEFLATE a été négocié.
+static inline int wire_decode_v2(int version, const unsigned char *body, size_t len,
+                                 struct message *msg, char *payload) {
+    memset(msg, 0, sizeof(struct message));
+    if (len < 1) return -1;
+
+    size_t pos = 0;
+    int compressed = body[pos] & WIRE_COMPRESSED;
+    if (compressed && version != WIRE_DEFLATE) return -1;
+    msg->type = (enum msg_type)(body[pos++] & ~WIRE_COMPRESSED);
+
+    uint32_t field_len;
+    int n = wire_get_varint(body + pos, len - pos, &field_len);
+    if (n <= 0 || field_len >= NICK_LEN || field_len > len - pos - n) return -1;
+    pos += n;
+    memcpy(msg->nick_sender, body + pos, field_len);
+    pos += field_len;
+
+    n = wire_get_varint(body + pos, len - pos, &field_len);
+    if (n <= 0 || field_len >= INFOS_LEN || field_len > len - pos - n) return -1;
+    pos += n;
+    memcpy(msg->infos, body + pos, field_len);
+    pos += field_len;
+
+    size_t pld_len = len - pos;
+    if (compressed) {
+        n = wire_inflate(body + pos, pld_len, payload, MSG_LEN - 1);
+        if (n < 0) return -1;
+        pld_len = n;
+    } else {
+        if (pld_len >= MSG_LEN) return -1;
+        memcpy(payload, body + pos, pld_len);
+    }
+    payload[pld_len] = '\0';
+    msg->pld_len = (int)pld_len;
+    return 0;
+}
+
+// Extrait une trame de buf ; retourne le nombre d'octets consommés,
+// 0 si la trame est incomplète et -1 si elle est invalide
+static inline int wire_parse(int version, const unsigned char *buf, size_t len,
+                             struct message *msg, char *payload) {
+    if (version == WIRE_LEGACY) {
+        if (len < sizeof(struct message)) return 0;
+        memcpy(msg, buf, sizeof(struct message));
+        if (msg->pld_len < 0 || msg->pld_len >= MSG_LEN) return -1;
+        if (len < sizeof(struct message) + msg->pld_len) return 0;
+        memcpy(payload, buf + sizeof(struct message), msg->pld_len);
+        payload[msg->pld_len] = '\0';
+        msg->nick_sender[NICK_LEN - 1] = '\0';
+        msg->infos[INFOS_LEN - 1] = '\0';
+        return (int)(sizeof(struct message) + msg->pld_len);
+    }
+
+    uint32_t body_len;
+    int prefix = wire_get_varint(buf, len, &body_len);
+    if (prefix <= 0) return prefix;
+    if (body_len > WIRE_MAX_FRAME) return -1;
+    if (len - prefix < body_len) return 0;
+    if (wire_decode_v2(version, buf + prefix, body_len, msg, payload) == -1) return -1;
+    return prefix + (int)body_len;
+}
+
+// Retourne 1 si une trame a été extraite, 0 s'il faut lire davantage, -1 si le flux est invalide
+static inline int wire_buffer_next(WireBuffer *buf, int version,
+                                   struct message *msg, char *payload) {
+    int used = wire_parse(version, buf->data + buf->start, buf->end - buf->start, msg, payload);
+    if (used <= 0) return used;
+    buf->start += used;
+    if (buf->start == buf->end) buf->start = buf->end = 0;
+    return 1;
+}
+
+// Ramène la trame partielle en tête pour libérer la fin du tampon
+static inline void wire_buffer_compact(WireBuffer *buf) {
+    if (buf->start == 0) return;
+    memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+    buf->end -= buf->start;
+    buf->start = 0;
+}
+
+#endif